@@ -0,0 +1,168 @@
+#include "GIF_fileWriter.h"
+#include "GIF_recorder.h"
+
+#include "Async/Async.h"
+#include "HAL/FileManager.h"
+
+#if PLATFORM_WINDOWS
+#include <io.h>
+#include "Windows/AllowWindowsPlatformTypes.h"
+#include <windows.h>
+#include "Windows/HideWindowsPlatformTypes.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+GIF_fileWriter::GIF_fileWriter()
+{
+}
+
+GIF_fileWriter::~GIF_fileWriter()
+{
+	if (IsOpen())
+	{
+		Close(false);
+	}
+}
+
+bool GIF_fileWriter::Open(const std::string& FilePath)
+{
+	FinalPath = UTF8_TO_TCHAR(FilePath.c_str());
+	TempPath = FinalPath + TEXT(".tmp");
+	// Narrow fopen would read the name in the ANSI code page on Windows, not as the UTF-8 the file manager moves and deletes
+#if PLATFORM_WINDOWS
+	File = _wfopen(*TempPath, TEXT("wb"));
+#else
+	File = fopen(TCHAR_TO_UTF8(*TempPath), "wb");
+#endif
+	if (File == nullptr)
+	{
+		return false;
+	}
+	// Every write is a whole chunk already, stdio buffering would only copy it once more
+	setvbuf(File, nullptr, _IONBF, 0);
+
+	for (TArray<uint8>& Chunk : Chunks)
+	{
+		Chunk.Reset(ChunkSize);
+	}
+	FillingChunk = 0;
+	bFailed = false;
+	BytesWritten = 0;
+	Preallocated = 0;
+	ChunkCount = 0;
+	WaitSeconds = 0.0;
+	return true;
+}
+
+void GIF_fileWriter::Preallocate(int64 Bytes)
+{
+	if (!IsOpen() || Bytes <= Preallocated)
+	{
+		return;
+	}
+	// The I/O thread owns the file while it writes
+	WaitForWrite();
+#if PLATFORM_WINDOWS
+	// Only reserves the clusters, _chsize_s would write the whole size in zeros before the frames are written over them
+	FILE_ALLOCATION_INFO AllocationInfo;
+	AllocationInfo.AllocationSize.QuadPart = Bytes;
+	const HANDLE Handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(File)));
+	const bool bAllocated = SetFileInformationByHandle(Handle, FileAllocationInfo, &AllocationInfo, sizeof(AllocationInfo)) != 0;
+#else
+	const bool bAllocated = posix_fallocate(fileno(File), 0, Bytes) == 0;
+#endif
+	if (bAllocated)
+	{
+		Preallocated = Bytes;
+	}
+}
+
+bool GIF_fileWriter::Write(const uint8* Bytes, int32 Length)
+{
+	BytesWritten += Length;
+	while (Length > 0)
+	{
+		TArray<uint8>& Chunk = Chunks[FillingChunk];
+		const int32 Count = FMath::Min(Length, ChunkSize - Chunk.Num());
+		Chunk.Append(Bytes, Count);
+		Bytes += Count;
+		Length -= Count;
+		if (Chunk.Num() >= ChunkSize)
+		{
+			Flush();
+		}
+	}
+	return !bFailed;
+}
+
+void GIF_fileWriter::Flush()
+{
+	if (Chunks[FillingChunk].Num() == 0)
+	{
+		return;
+	}
+	// The other chunk is free to fill once its write is done
+	WaitForWrite();
+	const int32 Chunk = FillingChunk;
+	PendingWrite = Async<bool>(EAsyncExecution::ThreadPool, [this, Chunk]()
+	{
+		const size_t Length = Chunks[Chunk].Num();
+		return fwrite(Chunks[Chunk].GetData(), 1, Length, File) == Length;
+	});
+	ChunkCount++;
+	FillingChunk ^= 1;
+	Chunks[FillingChunk].Reset(ChunkSize);
+}
+
+void GIF_fileWriter::WaitForWrite()
+{
+	if (PendingWrite.IsValid())
+	{
+		const double WaitStart = FPlatformTime::Seconds();
+		bFailed |= !PendingWrite.Get();
+		PendingWrite = TFuture<bool>();
+		WaitSeconds += FPlatformTime::Seconds() - WaitStart;
+	}
+}
+
+bool GIF_fileWriter::Close(bool bKeep)
+{
+	if (!IsOpen())
+	{
+		return false;
+	}
+	if (bKeep)
+	{
+		Flush();
+	}
+	WaitForWrite();
+
+#if !PLATFORM_WINDOWS
+	// posix_fallocate leaves the file longer than what was written, the Windows reservation keeps its end where it is
+	if (bKeep && Preallocated > BytesWritten)
+	{
+		bFailed |= ftruncate(fileno(File), BytesWritten) != 0;
+	}
+#endif
+	bFailed |= fclose(File) != 0;
+	File = nullptr;
+
+	if (bKeep && !bFailed && IFileManager::Get().Move(*FinalPath, *TempPath, true))
+	{
+		return true;
+	}
+	if (bKeep)
+	{
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not write %s"), *TempPath);
+	}
+	IFileManager::Get().Delete(*TempPath);
+	return false;
+}
+
+int GIF_fileWriter::GifOutput(GifFileType* GifFile, const GifByteType* Bytes, int Length)
+{
+	GIF_fileWriter* Writer = static_cast<GIF_fileWriter*>(GifFile->UserData);
+	return Writer->Write(Bytes, Length) ? Length : 0;
+}
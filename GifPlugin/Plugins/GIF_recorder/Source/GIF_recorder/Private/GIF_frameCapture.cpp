@@ -1,5 +1,7 @@
 #include "GIF_frameCapture.h"
+#include "GIF_recorder.h"
 
+#include <stdlib.h>
 #include <string>
 
 #include "Camera/CameraActor.h"
@@ -9,6 +11,11 @@
 #include "Components/SceneCaptureComponent2D.h"
 
 #include "Engine/World.h"
+#include "Async/Async.h"
+#include "Async/ParallelFor.h"
+#include "HAL/FileManager.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/ScopeLock.h"
 #include "Styling/SlateStyleRegistry.h"
 
 #include "Editor/UnrealEd/Classes/Editor/EditorEngine.h"
@@ -48,6 +55,13 @@ GIF_frameCapture::~GIF_frameCapture()
 {
 	FTicker::GetCoreTicker().RemoveTicker(TickDelegateHandle);
 
+	// A save still running works on this object, stop it first
+	CancelSave();
+	if (SaveTask.IsValid())
+	{
+		SaveTask.Wait();
+	}
+
 	if(RenderTarget != nullptr)
 		if(RenderTarget->IsRooted())
 			RenderTarget->RemoveFromRoot();
@@ -58,6 +72,25 @@ GIF_frameCapture::~GIF_frameCapture()
 			if(tex->IsRooted())
 				tex->RemoveFromRoot();
 	}
+
+	GifFreeQuantizeScratch(QuantizeScratch);
+	for (GifCompressedImage& Image : CompressedImages)
+	{
+		EGifFreeCompressedImage(&Image);
+	}
+	for (GifCodeStrip& Strip : CodeStrips)
+	{
+		EGifFreeCodeStrip(&Strip);
+	}
+	for (GifRasterEncoder* Encoder : EncoderPool)
+	{
+		EGifFreeRasterEncoder(Encoder);
+	}
+	for (ExtensionBlock* Blocks : ExtensionArrays)
+	{
+		free(Blocks);
+	}
+	free(SavedImages);
 }
 
 bool GIF_frameCapture::Tick(float DeltaTime)
@@ -235,26 +268,338 @@ bool GIF_frameCapture::StartRecording()
 
 void GIF_frameCapture::SaveGIF(std::string pathName, int32 startFrame, int32 endFrame)
 {
-	/* Open output file */
+	if (IsSaving())
+	{
+		UE_LOG(LogGIFRecorder, Warning, TEXT("A save is running already"));
+		return;
+	}
+	if (TakeSaveSnapshot(startFrame, endFrame))
+	{
+		WriteGIF(pathName, nullptr);
+	}
+}
+
+bool GIF_frameCapture::SaveGIFToMemory(int32 startFrame, int32 endFrame, TArray<uint8>& Bytes)
+{
+	Bytes.Reset();
+	if (IsSaving())
+	{
+		UE_LOG(LogGIFRecorder, Warning, TEXT("A save is running already"));
+		return false;
+	}
+	if (!TakeSaveSnapshot(startFrame, endFrame))
+	{
+		return false;
+	}
+	WriteGIF(std::string(), &Bytes);
+	return GetLastSaveResult() == EGIFSaveResult::Saved;
+}
+
+int GIF_frameCapture::WriteToMemory(GifFileType* GifFile, const GifByteType* Bytes, int Length)
+{
+	FMemoryOutput* Output = static_cast<FMemoryOutput*>(GifFile->UserData);
+	Output->Bytes->Append(Bytes, Length);
+	Output->WriteCount++;
+	return Length;
+}
+
+bool GIF_frameCapture::SaveGIFAsync(std::string pathName, int32 startFrame, int32 endFrame)
+{
+	if (IsSaving() || !TakeSaveSnapshot(startFrame, endFrame))
+	{
+		return false;
+	}
+
+	// The worker only reads the snapshot, so recording can go on meanwhile. Its own thread keeps the task graph workers free for the compression
+	bSaving = true;
+	SaveTask = Async<void>(EAsyncExecution::Thread, [this, pathName]()
+	{
+		WriteGIF(pathName, nullptr);
+		bSaving = false;
+	});
+	return true;
+}
+
+void GIF_frameCapture::CancelSave()
+{
+	bCancelSave = true;
+}
+
+bool GIF_frameCapture::TakeSaveSnapshot(int32 startFrame, int32 endFrame)
+{
+	startFrame = FMath::Max(startFrame, 0);
+	endFrame = FMath::Min(endFrame, static_cast<int32>(RedChannel.size()) - 1);
+	if (startFrame > endFrame)
+	{
+		UE_LOG(LogGIFRecorder, Warning, TEXT("No recorded frames to save"));
+		return false;
+	}
+
+	SaveWidth = RenderTarget->GetSurfaceWidth();
+	SaveHeight = RenderTarget->GetSurfaceHeight();
+	SaveRed.assign(RedChannel.begin() + startFrame, RedChannel.begin() + endFrame + 1);
+	SaveGreen.assign(GreenChannel.begin() + startFrame, GreenChannel.begin() + endFrame + 1);
+	SaveBlue.assign(BlueChannel.begin() + startFrame, BlueChannel.begin() + endFrame + 1);
+
+	bCancelSave = false;
+	SavedFrameCount.Reset();
+	SaveFrameTotal.Reset();
+	SetLastSave(EGIFSaveResult::None, 0, 0.0);
+	return true;
+}
+
+void GIF_frameCapture::SetLastSave(EGIFSaveResult Result, int64 Bytes, double Seconds)
+{
+	FScopeLock Lock(&LastSaveLock);
+	LastSaveResult = Result;
+	LastSaveBytes = Bytes;
+	LastSaveSeconds = Seconds;
+}
+
+EGIFSaveResult GIF_frameCapture::GetLastSaveResult() const
+{
+	FScopeLock Lock(&LastSaveLock);
+	return LastSaveResult;
+}
+
+int64 GIF_frameCapture::GetLastSaveBytes() const
+{
+	FScopeLock Lock(&LastSaveLock);
+	return LastSaveBytes;
+}
+
+double GIF_frameCapture::GetLastSaveSeconds() const
+{
+	FScopeLock Lock(&LastSaveLock);
+	return LastSaveSeconds;
+}
+
+void GIF_frameCapture::FinishSave(const std::string& filePath, EGIFSaveResult Result, double SaveStart)
+{
+	const FString Path = UTF8_TO_TCHAR(filePath.c_str());
+	double SaveSeconds = FPlatformTime::Seconds() - SaveStart;
+	int64 SaveBytes = 0;
+	if (MemoryOutput.Bytes != nullptr)
+	{
+		if (Result == EGIFSaveResult::Saved)
+		{
+			SaveBytes = MemoryOutput.Bytes->Num();
+			LastMemoryBytes = SaveBytes;
+			UE_LOG(LogGIFRecorder, Log, TEXT("Encoded %lld bytes into memory in %.2f s, %d writes of %lld bytes on average, %.2f MB/s"),
+				SaveBytes, SaveSeconds, MemoryOutput.WriteCount, SaveBytes / FMath::Max(MemoryOutput.WriteCount, 1),
+				SaveSeconds > 0.0 ? SaveBytes / SaveSeconds / (1024.0 * 1024.0) : 0.0);
+		}
+		else
+		{
+			MemoryOutput.Bytes->Reset();
+		}
+		MemoryOutput.Bytes = nullptr;
+	}
+	else
+	{
+		// The buffered file only replaces the old one once complete, otherwise half a gif is of no use, leave nothing behind
+		const bool bBuffered = FileWriter.IsOpen();
+		if (bBuffered)
+		{
+			if (!FileWriter.Close(Result == EGIFSaveResult::Saved) && Result == EGIFSaveResult::Saved)
+			{
+				Result = EGIFSaveResult::Failed;
+			}
+			SaveSeconds = FPlatformTime::Seconds() - SaveStart;
+		}
+		else if (Result == EGIFSaveResult::Cancelled)
+		{
+			IFileManager::Get().Delete(*Path);
+		}
+
+		if (Result == EGIFSaveResult::Saved)
+		{
+			SaveBytes = IFileManager::Get().FileSize(*Path);
+			UE_LOG(LogGIFRecorder, Log, TEXT("Saved %s, %lld bytes in %.2f s"), *Path, SaveBytes, SaveSeconds);
+			if (bBuffered)
+			{
+				UE_LOG(LogGIFRecorder, Log, TEXT("Wrote it in %d chunks of up to %d bytes, %.2f ms spent waiting for the disk"),
+					FileWriter.GetChunkCount(), FileWriter.ChunkSize, FileWriter.GetWaitSeconds() * 1000.0);
+			}
+		}
+		else if (Result == EGIFSaveResult::Cancelled)
+		{
+			UE_LOG(LogGIFRecorder, Log, TEXT("Save of %s cancelled after %.2f s"), *Path, SaveSeconds);
+		}
+	}
+	SetLastSave(Result, SaveBytes, SaveSeconds);
+
+	// The snapshot can be the size of the whole recording, it is not kept past the save
+	std::vector<std::vector<GifByteType>>().swap(SaveRed);
+	std::vector<std::vector<GifByteType>>().swap(SaveGreen);
+	std::vector<std::vector<GifByteType>>().swap(SaveBlue);
+}
+
+void GIF_frameCapture::WriteGIF(std::string pathName, TArray<uint8>* Bytes)
+{
+	const double SaveStart = FPlatformTime::Seconds();
+	const int32 startFrame = 0;
+	const int32 endFrame = static_cast<int32>(SaveRed.size()) - 1;
+
+	/* Open output file, or the buffer the gif is encoded into */
 	int ErrorCode;
-	std::string filePath = pathName + "/GIF.gif";
-	if ((GifFile = EGifOpenFileName(filePath.c_str(), false, &ErrorCode)) == NULL) {
-		// TODO: Add debug logging
+	std::string filePath = Bytes != nullptr ? std::string("memory") : pathName + "/GIF.gif";
+	if (Bytes != nullptr)
+	{
+		// The last in-memory save is a good guess of the size, past it the buffer grows geometrically
+		Bytes->Reset(static_cast<int32>(FMath::Max<int64>(LastMemoryBytes, 64 * 1024)));
+		MemoryOutput.Bytes = Bytes;
+		MemoryOutput.WriteCount = 0;
+		GifFile = EGifOpen(&MemoryOutput, &GIF_frameCapture::WriteToMemory, &ErrorCode);
+	}
+	else if (bBufferedWrite)
+	{
+		GifFile = FileWriter.Open(filePath) ? EGifOpen(&FileWriter, &GIF_fileWriter::GifOutput, &ErrorCode) : nullptr;
+	}
+	else
+	{
+		GifFile = EGifOpenFileName(filePath.c_str(), false, &ErrorCode);
+	}
+	if (GifFile == NULL) {
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not open %s"), UTF8_TO_TCHAR(filePath.c_str()));
+		FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
 		return;
 	}
 
-	SetupGif(RenderTarget->GetSurfaceWidth(), RenderTarget->GetSurfaceHeight());
+	const double MergeStart = FPlatformTime::Seconds();
+	MergeDuplicateFrames(startFrame, endFrame);
+	const double MergeSeconds = FPlatformTime::Seconds() - MergeStart;
+	SaveFrameTotal.Set(KeptFrames.Num());
 
-	for (int i = startFrame; i <= endFrame; i++)
+	EGifSetCompressLevel(GifFile, CompressLevel);
+	SetupGif(SaveWidth, SaveHeight);
+	// A streamed save holds a single frame at a time
+	if (!ReserveSaveStorage(bStreamFrames ? 1 : KeptFrames.Num(), SaveWidth, SaveHeight))
+	{
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not allocate the frames"));
+		EGifCloseFile(GifFile, &ErrorCode);
+		GifFile = nullptr;
+		FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
+		return;
+	}
+
+	QuantizeSeconds = 0.0;
+	PrunedColors = 0;
+	AppendedFrames = 0;
+	PreviousPlanes[0] = PreviousPlanes[1] = PreviousPlanes[2] = nullptr;
+	QualityReports.Reset();
+	if (bGlobalPalette && !BuildGlobalPalette(startFrame, endFrame, SaveWidth, SaveHeight))
+	{
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not build the global palette"));
+		GifFreeQuantizePalette(GlobalPalette);
+		GlobalPalette = nullptr;
+		EGifCloseFile(GifFile, &ErrorCode);
+		GifFile = nullptr;
+		FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
+		return;
+	}
+	bool bStreamed = true;
+	if (bStreamFrames)
+	{
+		bStreamed = StreamFrames();
+	}
+	else
+	{
+		for (int32 k = 0; k < KeptFrames.Num() && !bCancelSave; k++)
+		{
+			const int32 i = KeptFrames[k];
+			AppendFrameToGif(SaveRed[i], SaveGreen[i], SaveBlue[i], FrameSpans[k]);
+			SavedFrameCount.Increment();
+		}
+	}
+	GifFreeQuantizePalette(GlobalPalette);
+	GlobalPalette = nullptr;
+
+	const int32 FrameCount = KeptFrames.Num();
+	const double SecondsPerFrame = FrameCount > 0 ? QuantizeSeconds / FrameCount : 0.0;
+	UE_LOG(LogGIFRecorder, Log, TEXT("Quantized %d frames at %d bits per channel to at most %d colors with dither mode %d, %.2f ms per frame"),
+		FrameCount, QuantizeBits, GetColorLimit(), DitherMode, SecondsPerFrame * 1000.0);
+	if (PrunedColors > 0)
+	{
+		UE_LOG(LogGIFRecorder, Log, TEXT("Dropped %d colors left unused by dithering from the frame color maps"), PrunedColors);
+	}
+	if (bMergeDuplicateFrames)
+	{
+		const int32 MergedCount = endFrame - startFrame + 1 - FrameCount;
+		UE_LOG(LogGIFRecorder, Log, TEXT("Merged %d duplicate frames into the frames before them, found in %.2f ms, saving about %.2f ms of quantizing"),
+			MergedCount, MergeSeconds * 1000.0, (MergedCount * SecondsPerFrame - MergeSeconds) * 1000.0);
+	}
+
+	if (QualityReports.Num() > 0)
+	{
+		double MinPSNR = GIF_PSNR_IDENTICAL;
+		double MeanSSIM = 0.0;
+		for (const GifQuantizeReport& Report : QualityReports)
+		{
+			MinPSNR = FMath::Min(MinPSNR, Report.PSNR);
+			MeanSSIM += Report.SSIM;
+		}
+		UE_LOG(LogGIFRecorder, Log, TEXT("Quality: worst PSNR %.2f dB, mean SSIM %.4f"), MinPSNR, MeanSSIM / QualityReports.Num());
+	}
+
+	if (bStreamFrames)
+	{
+		// The frames are in the file already, closing it writes the trailer. GifFile is gone after it even if it fails
+		const int CloseResult = EGifCloseFile(GifFile, &ErrorCode);
+		GifFile = nullptr;
+		if (bCancelSave)
+		{
+			FinishSave(filePath, EGIFSaveResult::Cancelled, SaveStart);
+			return;
+		}
+		if (!bStreamed || CloseResult == GIF_ERROR)
+		{
+			UE_LOG(LogGIFRecorder, Error, TEXT("Could not write %s"), UTF8_TO_TCHAR(filePath.c_str()));
+			FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
+			return;
+		}
+		FinishSave(filePath, EGIFSaveResult::Saved, SaveStart);
+		return;
+	}
+
+	const bool bCompressed = !bCancelSave && (!bParallelEncode || CompressFrames());
+	if (bCancelSave)
+	{
+		EGifCloseFile(GifFile, &ErrorCode);
+		GifFile = nullptr;
+		FinishSave(filePath, EGIFSaveResult::Cancelled, SaveStart);
+		return;
+	}
+	if (!bCompressed)
+	{
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not compress the frames"));
+		EGifCloseFile(GifFile, &ErrorCode);
+		GifFile = nullptr;
+		FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
+		return;
+	}
+
+	// The compressed frames give the size of the file but for headers and color maps, room for it is made on disk at once
+	if (bParallelEncode && FileWriter.IsOpen())
 	{
-		AppendFrameToGif(RedChannel[i], GreenChannel[i], BlueChannel[i]);
+		int64 ExpectedBytes = 1024;
+		for (int32 Frame = 0; Frame < GifFile->ImageCount; Frame++)
+		{
+			ExpectedBytes += CompressedImages[Frame].Length + 1024;
+		}
+		FileWriter.Preallocate(ExpectedBytes);
 	}
 
-	//	 TODO: Add debugging output
-	if (EGifSpew(GifFile) == GIF_ERROR) {
-		// TODO: Add debug logging
+	// EGifSpew closes the file and frees GifFile on every path, a failed write included
+	const int SpewResult = bParallelEncode ? EGifSpewCompressed(GifFile, CompressedImages.GetData()) : EGifSpew(GifFile);
+	GifFile = nullptr;
+	if (SpewResult == GIF_ERROR)
+	{
+		UE_LOG(LogGIFRecorder, Error, TEXT("Could not write %s"), UTF8_TO_TCHAR(filePath.c_str()));
+		FinishSave(filePath, EGIFSaveResult::Failed, SaveStart);
 		return;
 	}
+	FinishSave(filePath, EGIFSaveResult::Saved, SaveStart);
 }
 
 void GIF_frameCapture::StopRecording()
@@ -271,103 +616,519 @@ void GIF_frameCapture::SetupGif(int ImageWidth, int ImageHeight)
 	GifFile->SColorResolution = GifBitSize(256);
 }
 
+bool GIF_frameCapture::ReserveSaveStorage(int32 FrameCount, int ImageWidth, int ImageHeight)
+{
+	const int32 PixelCount = ImageWidth * ImageHeight;
+
+	// The frame array is giflib's own, grown by it and handed from one GifFile to the next
+	GifFile->SavedImages = SavedImages;
+	GifFile->SavedImageCapacity = SavedImageCapacity;
+	GifFile->ImageCount = 0;
+	const int ReserveResult = GifReserveSavedImages(GifFile, FrameCount);
+	SavedImages = GifFile->SavedImages;
+	SavedImageCapacity = GifFile->SavedImageCapacity;
+	if (ReserveResult == GIF_ERROR)
+	{
+		return false;
+	}
+
+	// Keep the capacity of earlier saves, a save of the same size allocates nothing
+	RasterStorage.SetNumUninitialized(FrameCount * PixelCount, false);
+	ColorMapStorage.SetNumUninitialized(FrameCount, false);
+	ColorStorage.SetNumUninitialized(FrameCount * 256, false);
+	ExtensionBytes.SetNumUninitialized(FrameCount * 4, false);
+
+	// Each frame gets a block array from giflib's allocator, one GifAddExtensionBlock can grow
+	while (ExtensionArrays.Num() < FrameCount)
+	{
+		ExtensionBlock* Blocks = static_cast<ExtensionBlock*>(reallocarray(nullptr, ExtensionsPerFrame, sizeof(ExtensionBlock)));
+		if (Blocks == nullptr)
+		{
+			return false;
+		}
+		ExtensionArrays.Add(Blocks);
+	}
+
+	if (QuantizeScratch == nullptr)
+	{
+		QuantizeScratch = GifNewQuantizeScratch(ImageWidth, ImageHeight);
+	}
+	return true;
+}
+
+bool GIF_frameCapture::CompressFrames()
+{
+	const int32 FrameCount = GifFile->ImageCount;
+	if (CompressedImages.Num() < FrameCount)
+	{
+		CompressedImages.AddZeroed(FrameCount - CompressedImages.Num());
+	}
+
+	// Work items are frames, or strips of frames; a frame cut in strips is joined by the worker finishing its last strip.
+	// Every strip needs a row of every frame, and frames cropped to their changes can be short
+	int32 MinHeight = FrameCount > 0 ? GifFile->SavedImages[0].ImageDesc.Height : 1;
+	for (int32 Frame = 1; Frame < FrameCount; Frame++)
+	{
+		MinHeight = FMath::Min(MinHeight, GifFile->SavedImages[Frame].ImageDesc.Height);
+	}
+	const int32 StripCount = FMath::Clamp(EncodeStrips, 1, MinHeight);
+	const int32 ItemCount = FrameCount * StripCount;
+	if (StripCount > 1)
+	{
+		if (CodeStrips.Num() < ItemCount)
+		{
+			CodeStrips.AddZeroed(ItemCount - CodeStrips.Num());
+		}
+		StripsLeft.Init(FThreadSafeCounter(StripCount), FrameCount);
+	}
+
+	// Every worker owns an encoder, dictionary included, and takes the next item until none is left.
+	// The encoders stay in the pool, a streamed save would otherwise make and free them for every frame
+	const int32 WorkerCount = FMath::Min(ItemCount, FTaskGraphInterface::Get().GetNumWorkerThreads() + 1);
+	while (EncoderPool.Num() < WorkerCount)
+	{
+		GifRasterEncoder* Encoder = EGifNewRasterEncoder();
+		if (Encoder == nullptr)
+		{
+			return false;
+		}
+		EncoderPool.Add(Encoder);
+	}
+	FThreadSafeCounter NextItem;
+	FThreadSafeCounter Failures;
+	const double CompressStart = FPlatformTime::Seconds();
+	ParallelFor(WorkerCount, [&](int32 Worker)
+	{
+		GifRasterEncoder* Encoder = EncoderPool[Worker];
+		EGifSetEncoderCompressLevel(Encoder, CompressLevel);
+		// An encoder from the pool may still be lossy from an earlier save
+		EGifSetEncoderLossy(Encoder, 0, nullptr, NO_TRANSPARENT_COLOR);
+		for (int32 Item = NextItem.Increment() - 1; Item < ItemCount && !bCancelSave; Item = NextItem.Increment() - 1)
+		{
+			const int32 Frame = Item / StripCount;
+			const SavedImage& Image = GifFile->SavedImages[Frame];
+			const ColorMapObject* ColorMap = Image.ImageDesc.ColorMap != nullptr ? Image.ImageDesc.ColorMap : GifFile->SColorMap;
+			const int32 Width = Image.ImageDesc.Width;
+			const int32 Height = Image.ImageDesc.Height;
+			if (LossyError > 0)
+			{
+				// The transparent color shows the frame before, it must not stand in for a color nor be replaced
+				GraphicsControlBlock gcb;
+				gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+				DGifSavedExtensionToGCB(GifFile, Frame, &gcb);
+				EGifSetEncoderLossy(Encoder, LossyError, ColorMap, gcb.TransparentColor);
+			}
+			if (StripCount == 1)
+			{
+				if (EGifCompressRaster(Encoder, Image.RasterBits, Width * Height, ColorMap->BitsPerPixel, &CompressedImages[Frame]) != GIF_OK)
+				{
+					Failures.Increment();
+				}
+				continue;
+			}
+
+			const int32 Strip = Item % StripCount;
+			const int32 FirstRow = Height * Strip / StripCount;
+			const int32 EndRow = Height * (Strip + 1) / StripCount;
+			if (EGifCompressStrip(Encoder, Image.RasterBits + FirstRow * Width, (EndRow - FirstRow) * Width, ColorMap->BitsPerPixel, &CodeStrips[Item]) != GIF_OK)
+			{
+				Failures.Increment();
+			}
+			if (StripsLeft[Frame].Decrement() == 0
+				&& EGifJoinStrips(Encoder, &CodeStrips[Frame * StripCount], StripCount, &CompressedImages[Frame]) != GIF_OK)
+			{
+				Failures.Increment();
+			}
+		}
+	});
+
+	uint64 CompressedBytes = 0;
+	uint64 LossyPixels = 0;
+	uint64 PixelCount = 0;
+	for (int32 Frame = 0; Frame < FrameCount; Frame++)
+	{
+		CompressedBytes += CompressedImages[Frame].Length;
+		LossyPixels += CompressedImages[Frame].LossyPixels;
+		PixelCount += GifFile->SavedImages[Frame].ImageDesc.Width * GifFile->SavedImages[Frame].ImageDesc.Height;
+	}
+	// A streamed save compresses frame by frame, once per frame is too chatty for the log
+	if (bStreamFrames)
+	{
+		UE_LOG(LogGIFRecorder, Verbose, TEXT("Compressed %d frames in %d strips each at level %d on %d workers in %.2f ms, %llu bytes"),
+			FrameCount, StripCount, CompressLevel, WorkerCount, (FPlatformTime::Seconds() - CompressStart) * 1000.0, CompressedBytes);
+	}
+	else
+	{
+		UE_LOG(LogGIFRecorder, Log, TEXT("Compressed %d frames in %d strips each at level %d on %d workers in %.2f ms, %llu bytes"),
+			FrameCount, StripCount, CompressLevel, WorkerCount, (FPlatformTime::Seconds() - CompressStart) * 1000.0, CompressedBytes);
+		if (LossyError > 0)
+		{
+			UE_LOG(LogGIFRecorder, Log, TEXT("Lossy LZW wrote %llu of %llu pixels, %.2f%%, as a color at most %d away"),
+				LossyPixels, PixelCount, PixelCount > 0 ? 100.0 * LossyPixels / PixelCount : 0.0, LossyError);
+		}
+	}
+	return Failures.GetValue() == 0;
+}
+
+bool GIF_frameCapture::StreamFrames()
+{
+	// The version is stamped with the screen descriptor, before any frame shows it needs gif89 extensions
+	EGifSetGifVersion(GifFile, true);
+	if (EGifPutScreenDesc(GifFile, GifFile->SWidth, GifFile->SHeight, GifFile->SColorResolution, GifFile->SBackGroundColor, GifFile->SColorMap) == GIF_ERROR)
+	{
+		return false;
+	}
+
+	for (int32 k = 0; k < KeptFrames.Num(); k++)
+	{
+		if (bCancelSave)
+		{
+			return false;
+		}
+		// Every frame is quantized into the storage of the previous one, which is written already
+		const int32 i = KeptFrames[k];
+		GifFile->ImageCount = 0;
+		AppendFrameToGif(SaveRed[i], SaveGreen[i], SaveBlue[i], FrameSpans[k]);
+		SavedFrameCount.Increment();
+		if (GifFile->ImageCount == 0)
+		{
+			continue;
+		}
+		if (bParallelEncode && !CompressFrames())
+		{
+			return false;
+		}
+		if (EGifPutSavedImage(GifFile, &GifFile->SavedImages[0], bParallelEncode ? &CompressedImages[0] : nullptr) == GIF_ERROR)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void GIF_frameCapture::MergeDuplicateFrames(int32 startFrame, int32 endFrame)
+{
+	const int32 PixelCount = SaveWidth * SaveHeight;
+	// A frame with more pixels past the pixel tolerance than this is not a duplicate
+	const int32 ChangeLimit = static_cast<int32>(FMath::Clamp(DuplicateFrameTolerance, 0.0f, 1.0f) * PixelCount);
+
+	KeptFrames.Reset();
+	FrameSpans.Reset();
+	for (int32 i = startFrame; i <= endFrame; i++)
+	{
+		// Compare with the frame kept rather than the one before, so a slow change cannot merge away bit by bit
+		if (bMergeDuplicateFrames && KeptFrames.Num() > 0)
+		{
+			const int32 Kept = KeptFrames.Last();
+			const GifByteType* KeptPlanes[3] = { SaveRed[Kept].data(), SaveGreen[Kept].data(), SaveBlue[Kept].data() };
+			const GifByteType* Planes[3] = { SaveRed[i].data(), SaveGreen[i].data(), SaveBlue[i].data() };
+			if (EGifCountChanges(PixelCount, 3, KeptPlanes, Planes, DuplicatePixelTolerance, ChangeLimit) <= ChangeLimit)
+			{
+				FrameSpans.Last()++;
+				continue;
+			}
+		}
+		KeptFrames.Add(i);
+		FrameSpans.Add(1);
+	}
+}
+
+GifQuantizeOptions GIF_frameCapture::MakeQuantizeOptions() const
+{
+	GifQuantizeOptions QuantizeOptions;
+	QuantizeOptions.BitsPerPrimColor = QuantizeBits;
+	QuantizeOptions.DitherMode = DitherMode;
+	QuantizeOptions.Scratch = QuantizeScratch;
+	// Per-frame palettes count every pixel, the global palette samples
+	QuantizeOptions.SampleStride = bGlobalPalette ? 0 : 1;
+	QuantizeOptions.SampleSeed = 1;
+	QuantizeOptions.TransparentMask = nullptr;
+	return QuantizeOptions;
+}
+
+int GIF_frameCapture::GetColorLimit() const
+{
+	// A table holds a power of two colors, a limit in between would only cost the code size of the next one
+	return 1 << FMath::FloorLog2(static_cast<uint32>(FMath::Clamp(MaxColors, 2, 256)));
+}
+
+bool GIF_frameCapture::BuildGlobalPalette(int32 startFrame, int32 endFrame, int ImageWidth, int ImageHeight)
+{
+	const GifQuantizeOptions QuantizeOptions = MakeQuantizeOptions();
+	const double QuantizeStart = FPlatformTime::Seconds();
+
+	GlobalPalette = GifNewQuantizePalette(&QuantizeOptions);
+	if (GlobalPalette == nullptr)
+	{
+		return false;
+	}
+	for (int i = startFrame; i <= endFrame; i++)
+	{
+		if (GifQuantizePaletteAdd(GlobalPalette, ImageWidth, ImageHeight, SaveRed[i].data(), SaveGreen[i].data(), SaveBlue[i].data()) != GIF_OK)
+		{
+			return false;
+		}
+	}
+
+	// With bTransparentDelta the entry after the colors is left for the transparent one
+	int ColorCount = GetColorLimit() - (bTransparentDelta ? 1 : 0);
+	// GifMakeMapObject copies up to the next power of two, the entries past the palette must be black too
+	GifColorType Colors[256] = {};
+	if (GifQuantizePaletteBuild(GlobalPalette, &ColorCount, Colors) != GIF_OK)
+	{
+		return false;
+	}
+	QuantizeSeconds += FPlatformTime::Seconds() - QuantizeStart;
+	if (bTransparentDelta)
+	{
+		GlobalTransparentIndex = ColorCount;
+		Colors[ColorCount++] = { 0, 0, 0 };
+	}
+
+	// EGifCloseFile frees the screen color map
+	GifFile->SColorMap = GifMakeMapObject(ColorCount, Colors);
+	return GifFile->SColorMap != nullptr;
+}
+
 void GIF_frameCapture::AppendFrameToGif(std::vector<GifByteType>& RedChannel,
 	std::vector<GifByteType>& GreenChannel,
-	std::vector<GifByteType>& BlueChannel)
+	std::vector<GifByteType>& BlueChannel,
+	int32 FrameSpan)
 {
-	int ImageWidth = RenderTarget->GetSurfaceWidth();
-	int ImageHeight = RenderTarget->GetSurfaceHeight();
-
-	// Create local color map and raster bits
-	int ColorCount = 256;
-	GifByteType* RasterBits;
-	if ((RasterBits = (GifByteType*)malloc(sizeof(GifByteType) * ImageWidth * ImageHeight)) == NULL) {
-		// TODO: Add debug logging
-		return;
+	int ImageWidth = SaveWidth;
+	int ImageHeight = SaveHeight;
+	const int32 Frame = GifFile->ImageCount;
+
+	// Only the rectangle that changed since the last frame is written, over the last frame left in place
+	GifImageDesc Rect;
+	Rect.Left = 0;
+	Rect.Top = 0;
+	Rect.Width = ImageWidth;
+	Rect.Height = ImageHeight;
+	const GifByteType* Planes[3] = { RedChannel.data(), GreenChannel.data(), BlueChannel.data() };
+	if (bCropToChanges && PreviousPlanes[0] != nullptr)
+	{
+		if (!EGifChangedRect(ImageWidth, ImageHeight, 3, PreviousPlanes, Planes, &Rect))
+		{
+			// A frame the same as the last one still has to show for its delay, one pixel of it will do
+			Rect.Width = 1;
+			Rect.Height = 1;
+		}
+		if (DitherMode == GIF_DITHER_ORDERED)
+		{
+			// Keep the threshold matrix on the same grid as the pixels left from earlier frames
+			Rect.Width += Rect.Left & 7;
+			Rect.Height += Rect.Top & 7;
+			Rect.Left &= ~7;
+			Rect.Top &= ~7;
+		}
 	}
-	GifColorType* Colors = (GifColorType*)malloc(sizeof(GifColorType) * ColorCount);
-	if ((Colors = (GifColorType*)malloc(sizeof(GifColorType) * ColorCount)) == NULL) {
-		// TODO: Add debug logging
-		return;
+
+	// Pixels of the rectangle within TransparentTolerance of what shows already are left transparent
+	const int32 RectPixels = Rect.Width * Rect.Height;
+	int32 TransparentPixels = 0;
+	if (bTransparentDelta && PreviousPlanes[0] != nullptr)
+	{
+		TransparentMask.SetNumUninitialized(RectPixels, false);
+		for (int y = 0; y < Rect.Height; y++)
+		{
+			const int32 Row = (Rect.Top + y) * ImageWidth + Rect.Left;
+			for (int x = 0; x < Rect.Width; x++)
+			{
+				const bool bSame = FMath::Abs(Planes[0][Row + x] - PreviousPlanes[0][Row + x]) <= TransparentTolerance
+					&& FMath::Abs(Planes[1][Row + x] - PreviousPlanes[1][Row + x]) <= TransparentTolerance
+					&& FMath::Abs(Planes[2][Row + x] - PreviousPlanes[2][Row + x]) <= TransparentTolerance;
+				TransparentMask[y * Rect.Width + x] = bSame;
+				TransparentPixels += bSame;
+			}
+		}
 	}
-	if (GifQuantizeBuffer(
-		ImageWidth,
-		ImageHeight,
-		&ColorCount,
-		RedChannel.data(),
-		GreenChannel.data(),
-		BlueChannel.data(),
-		RasterBits,
-		Colors) != GIF_OK)
+	const bool bTransparent = TransparentPixels > 0;
+
+	// Quantize the rectangle from a copy of it unless it is the whole frame, or its transparent pixels are changed for the metrics
+	GifByteType* Red = RedChannel.data();
+	GifByteType* Green = GreenChannel.data();
+	GifByteType* Blue = BlueChannel.data();
+	if (RectPixels != ImageWidth * ImageHeight || (bTransparent && bComputeQualityMetrics))
 	{
-		// TODO: Add debug logging here
-		return;
+		CropStorage.SetNumUninitialized(3 * RectPixels, false);
+		Red = CropStorage.GetData();
+		Green = Red + RectPixels;
+		Blue = Green + RectPixels;
+		for (int y = 0; y < Rect.Height; y++)
+		{
+			const int32 Source = (Rect.Top + y) * ImageWidth + Rect.Left;
+			FMemory::Memcpy(Red + y * Rect.Width, &RedChannel[Source], Rect.Width);
+			FMemory::Memcpy(Green + y * Rect.Width, &GreenChannel[Source], Rect.Width);
+			FMemory::Memcpy(Blue + y * Rect.Width, &BlueChannel[Source], Rect.Width);
+		}
+	}
+
+	// Local color map and raster bits live in the storage reserved for this save. The quantizer keeps the transparent entry within the count
+	int ColorCount = GetColorLimit();
+	GifByteType* RasterBits = &RasterStorage[Frame * ImageWidth * ImageHeight];
+	GifColorType* Colors = &ColorStorage[Frame * 256];
+
+	GifQuantizeOptions QuantizeOptions = MakeQuantizeOptions();
+	QuantizeOptions.TransparentMask = bTransparent ? TransparentMask.GetData() : nullptr;
+
+	const double QuantizeStart = FPlatformTime::Seconds();
+	int QuantizeResult;
+	if (GlobalPalette != nullptr)
+	{
+		QuantizeResult = GifQuantizePaletteMap(
+			GlobalPalette,
+			Rect.Width,
+			Rect.Height,
+			Red,
+			Green,
+			Blue,
+			RasterBits);
+		Colors = GifFile->SColorMap->Colors;
+		for (int32 i = 0; bTransparent && i < RectPixels; i++)
+		{
+			if (TransparentMask[i])
+			{
+				RasterBits[i] = GlobalTransparentIndex;
+			}
+		}
+	}
+	else
+	{
+		QuantizeResult = GifQuantizeBufferEx(
+			Rect.Width,
+			Rect.Height,
+			&ColorCount,
+			Red,
+			Green,
+			Blue,
+			RasterBits,
+			Colors,
+			&QuantizeOptions);
 	}
-	ColorMapObject* ColorMap;
-	if ((ColorMap = GifMakeMapObject(ColorCount, Colors)) == NULL) {
+	QuantizeSeconds += FPlatformTime::Seconds() - QuantizeStart;
+
+	if (QuantizeResult != GIF_OK)
+	{
 		// TODO: Add debug logging here
 		return;
 	}
-	free(Colors);
+	// Without dithering every color of the median cut has pixels. With it some can be left unused, and dropping them can halve the table
+	if (GlobalPalette == nullptr && DitherMode != GIF_DITHER_NONE)
+	{
+		const int QuantizedCount = ColorCount;
+		GifPruneColorMap(RectPixels, RasterBits, &ColorCount, Colors);
+		PrunedColors += QuantizedCount - ColorCount;
+	}
+	// The quantizer puts the transparent entry after the colors of the frame
+	const int TransparentIndex = !bTransparent ? NO_TRANSPARENT_COLOR : (GlobalPalette != nullptr ? GlobalTransparentIndex : ColorCount - 1);
 
-	// Create image descriptor
-	GifFile->Image.Left = 0;
-	GifFile->Image.Top = 0;
-	GifFile->Image.Width = ImageWidth;
-	GifFile->Image.Height = ImageHeight;
-	GifFile->Image.Interlace = false;
-	GifFile->Image.ColorMap = ColorMap;
+	if (bComputeQualityMetrics)
+	{
+		// Bands of rows are measured on the task graph workers, each into sums of its own
+		const int32 BandCount = (Rect.Height + MetricsBandRows - 1) / MetricsBandRows;
+		MetricsSums.SetNumZeroed(BandCount);
+		ParallelFor(BandCount, [&](int32 Band)
+		{
+			const int32 FirstRow = Band * MetricsBandRows;
+			const int32 EndRow = FMath::Min(FirstRow + MetricsBandRows, Rect.Height);
+			// Transparent pixels show what was measured with the frame that wrote them, they count as exact here
+			for (int32 i = FirstRow * Rect.Width; bTransparent && i < EndRow * Rect.Width; i++)
+			{
+				if (TransparentMask[i])
+				{
+					Red[i] = Colors[TransparentIndex].Red;
+					Green[i] = Colors[TransparentIndex].Green;
+					Blue[i] = Colors[TransparentIndex].Blue;
+				}
+			}
+			GifQuantizeMetricsRows(Rect.Width, Rect.Height, FirstRow, EndRow, Red, Green, Blue, RasterBits, Colors, &MetricsSums[Band]);
+		});
+		GifQuantizeReport Report;
+		if (GifQuantizeMetricsReport(MetricsSums.GetData(), BandCount, &Report) == GIF_OK)
+		{
+			QualityReports.Add(Report);
+		}
+	}
+
+	// The color table of a gif holds a power of two colors, the quantizer cleared the unused tail.
+	// Frames mapped through the global palette use the screen color map instead
+	ColorMapObject* ColorMap = nullptr;
+	if (GlobalPalette == nullptr)
+	{
+		ColorMap = &ColorMapStorage[Frame];
+		ColorMap->BitsPerPixel = GifBitSize(ColorCount);
+		ColorMap->ColorCount = 1 << ColorMap->BitsPerPixel;
+		ColorMap->SortFlag = false;
+		ColorMap->Colors = Colors;
+	}
 
 	// Save Gif frame
-	GifMakeSavedImage(GifFile, NULL);
-	SavedImage* sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
-	memcpy(&sp->ImageDesc, &GifFile->Image, sizeof(GifImageDesc));
+	const bool bFirstFrame = AppendedFrames++ == 0;
+	SavedImage* sp = &GifFile->SavedImages[GifFile->ImageCount++];
+	FMemory::Memzero(sp, sizeof(SavedImage));
+	sp->ImageDesc.Left = Rect.Left;
+	sp->ImageDesc.Top = Rect.Top;
+	sp->ImageDesc.Width = Rect.Width;
+	sp->ImageDesc.Height = Rect.Height;
+	sp->ImageDesc.Interlace = false;
 	sp->ImageDesc.ColorMap = ColorMap;
 	sp->RasterBits = RasterBits;
 	sp->ExtensionBlockCount = 0;
-	sp->ExtensionBlocks = (ExtensionBlock *)NULL;
+	sp->ExtensionBlocks = ExtensionArrays[Frame];
 
-	if (GifFile->ImageCount == 1) {
-		// Add Netscape 2.0 loop block
-		if (GifAddExtensionBlock(
-			&sp->ExtensionBlockCount,
-			&sp->ExtensionBlocks,
-			APPLICATION_EXT_FUNC_CODE,
-			11,
-			(unsigned char *)"NETSCAPE2.0") == GIF_ERROR)
-		{
-			// TODO: Add debug logging here
-			return;
+	// Next frame is compared with this one, or with bTransparentDelta with the pixels last written, so changes under the tolerance cannot add up unseen
+	if (bTransparentDelta)
+	{
+		const int32 PixelCount = ImageWidth * ImageHeight;
+		if (PreviousPlanes[0] == nullptr)
+		{
+			CanvasStorage.SetNumUninitialized(3 * PixelCount, false);
+			for (int p = 0; p < 3; p++)
+			{
+				FMemory::Memcpy(&CanvasStorage[p * PixelCount], Planes[p], PixelCount);
+				PreviousPlanes[p] = &CanvasStorage[p * PixelCount];
+			}
 		}
-		unsigned char params[3] = { 1, 0, 0 }; // first byte always 1, remaining bytes are 16 bit unsigned int loop count
-		if (GifAddExtensionBlock(
-			&sp->ExtensionBlockCount,
-			&sp->ExtensionBlocks,
-			CONTINUE_EXT_FUNC_CODE,
-			sizeof(params),
-			params) == GIF_ERROR)
+		else
 		{
-			// TODO: Add debug logging here
-			return;
+			for (int y = 0; y < Rect.Height; y++)
+			{
+				const int32 Row = (Rect.Top + y) * ImageWidth + Rect.Left;
+				for (int x = 0; x < Rect.Width; x++)
+				{
+					if (!bTransparent || !TransparentMask[y * Rect.Width + x])
+					{
+						for (int p = 0; p < 3; p++)
+						{
+							CanvasStorage[p * PixelCount + Row + x] = Planes[p][Row + x];
+						}
+					}
+				}
+			}
 		}
 	}
+	else
+	{
+		FMemory::Memcpy(PreviousPlanes, Planes, sizeof(Planes));
+	}
+
+	if (bFirstFrame) {
+		// Add Netscape 2.0 loop block
+		static GifByteType NetscapeId[] = { 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0' };
+		static GifByteType LoopParams[] = { 1, 0, 0 }; // first byte always 1, remaining bytes are 16 bit unsigned int loop count
+		sp->ExtensionBlocks[sp->ExtensionBlockCount++] = { sizeof(NetscapeId), NetscapeId, APPLICATION_EXT_FUNC_CODE };
+		sp->ExtensionBlocks[sp->ExtensionBlockCount++] = { sizeof(LoopParams), LoopParams, CONTINUE_EXT_FUNC_CODE };
+	}
 
 	// Add GCB Extension block
 	GraphicsControlBlock gcb;
-	gcb.DelayTime = static_cast<int>(100.0f * FPS);
+	// A frame standing for merged duplicates shows as long as all of them would have
+	gcb.DelayTime = FrameSpan * static_cast<int>(100.0f * FPS);
 	gcb.DisposalMode = DISPOSE_DO_NOT;
-	gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+	gcb.TransparentColor = TransparentIndex;
 	gcb.UserInputFlag = false;
-	GifByteType GifExtension[4];
+	GifByteType* GifExtension = &ExtensionBytes[Frame * 4];
 	size_t Len = EGifGCBToExtension(&gcb, GifExtension);
-	if (GifAddExtensionBlock(
-		&sp->ExtensionBlockCount,
-		&sp->ExtensionBlocks,
-		GRAPHICS_EXT_FUNC_CODE,
-		Len,
-		(unsigned char *)GifExtension) == GIF_ERROR)
-	{
-		// TODO: Add debug logging here
-		return;
-	}
+	sp->ExtensionBlocks[sp->ExtensionBlockCount++] = { static_cast<int>(Len), GifExtension, GRAPHICS_EXT_FUNC_CODE };
 }
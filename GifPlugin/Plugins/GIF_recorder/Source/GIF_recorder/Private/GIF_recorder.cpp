@@ -36,6 +36,8 @@
 
 static const FName GIF_recorderTabName("GIF_recorder");
 
+DEFINE_LOG_CATEGORY(LogGIFRecorder);
+
 #define LOCTEXT_NAMESPACE "FGIF_recorderModule"
 
 void FGIF_recorderModule::StartupModule()
@@ -322,6 +324,43 @@ TSharedRef<SDockTab> FGIF_recorderModule::OnSpawnPluginTab(const FSpawnTabArgs&
 							]
 						]
 				]
+
+			//==============================Save Progress==========================
+			+ SVerticalBox::Slot()
+				.Padding(0.0f, 8.0f, 0.0f, 8.0f)
+				.VAlign(VAlign_Top)
+				.HAlign(HAlign_Center)
+				[
+					SNew(SHorizontalBox)
+
+					+ SHorizontalBox::Slot()
+						.Padding(0.0f, 0.0f, 2.0f, 0.0f)
+						.AutoWidth()
+						.VAlign(VAlign_Center)
+						[
+							SNew(SBox)
+							[
+								SNew(SButton)
+								.OnClicked_Raw(this, &FGIF_recorderModule::CancelSaveButtonClicked)
+								.IsEnabled_Raw(this, &FGIF_recorderModule::IsSaving)
+								.VAlign(VAlign_Fill)
+								.HAlign(HAlign_Fill)
+								[
+									SNew(STextBlock)
+									.Text(NSLOCTEXT("WindowWidgetText", "testKey7", "Cancel Save"))
+								]
+							]
+						]
+
+					+ SHorizontalBox::Slot()
+						.Padding(4.0f, 0.0f, 0.0f, 0.0f)
+						.AutoWidth()
+						.VAlign(VAlign_Center)
+						[
+							SNew(STextBlock)
+							.Text_Raw(this, &FGIF_recorderModule::GetSaveStatusText)
+						]
+				]
 			]
 		];
 }
@@ -376,12 +415,53 @@ void FGIF_recorderModule::PluginRecordButtonClicked()
 
 FReply FGIF_recorderModule::SaveButtonClicked()
 {
-	/* Mad Comment: Call save gif using variables stored in this class */
-	recorder->SaveGIF(std::string(TCHAR_TO_UTF8(*SavePath.ToString())), StartTime, EndTime);
+	/* Mad Comment: Call save gif using variables stored in this class. It saves in the background, a click while it runs does nothing */
+	recorder->SaveGIFAsync(std::string(TCHAR_TO_UTF8(*SavePath.ToString())), StartTime, EndTime);
 
 	return FReply::Handled();
 }
 
+FReply FGIF_recorderModule::CancelSaveButtonClicked()
+{
+	recorder->CancelSave();
+
+	return FReply::Handled();
+}
+
+bool FGIF_recorderModule::IsSaving() const
+{
+	return recorder->IsSaving();
+}
+
+FText FGIF_recorderModule::GetSaveStatusText() const
+{
+	if (recorder->IsSaving())
+	{
+		const int32 Total = recorder->GetSaveFrameTotal();
+		if (Total == 0)
+		{
+			return LOCTEXT("SavePreparing", "Preparing save...");
+		}
+		if (recorder->GetSavedFrameCount() < Total)
+		{
+			return FText::Format(LOCTEXT("SaveProgress", "Saving frame {0} of {1}"), FText::AsNumber(recorder->GetSavedFrameCount() + 1), FText::AsNumber(Total));
+		}
+		return LOCTEXT("SaveWriting", "Writing file...");
+	}
+
+	switch (recorder->GetLastSaveResult())
+	{
+	case EGIFSaveResult::Saved:
+		return FText::Format(LOCTEXT("SaveDone", "Saved {0} in {1} s"), FText::AsMemory(recorder->GetLastSaveBytes()), FText::AsNumber(recorder->GetLastSaveSeconds()));
+	case EGIFSaveResult::Cancelled:
+		return LOCTEXT("SaveCancelled", "Save cancelled");
+	case EGIFSaveResult::Failed:
+		return LOCTEXT("SaveFailed", "Save failed, see the log");
+	default:
+		return FText::GetEmpty();
+	}
+}
+
 FReply FGIF_recorderModule::SelectPathButtonClicked()
 {
 	/* Seb Comment: Retrieve save path from default windows file navigator */
@@ -393,21 +393,9 @@ DGifGetImageDesc(GifFileType *GifFile)
         }
     }
 
-    if (GifFile->SavedImages) {
-        SavedImage* new_saved_images =
-            (SavedImage *)reallocarray(GifFile->SavedImages,
-                            (GifFile->ImageCount + 1), sizeof(SavedImage));
-        if (new_saved_images == NULL) {
-            GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
-            return GIF_ERROR;
-        }
-        GifFile->SavedImages = new_saved_images;
-    } else {
-        if ((GifFile->SavedImages =
-             (SavedImage *) malloc(sizeof(SavedImage))) == NULL) {
-            GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
-            return GIF_ERROR;
-        }
+    if (GifGrowSavedImages(GifFile) == GIF_ERROR) {
+        GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
     }
 
     sp = &GifFile->SavedImages[GifFile->ImageCount];
@@ -1083,6 +1071,7 @@ DGifSlurp(GifFileType *GifFile)
     SavedImage *sp;
     GifByteType *ExtData;
     int ExtFunction;
+    int ExtensionBlockCapacity = 0;  /* Of GifFile->ExtensionBlocks */
 
     GifFile->ExtensionBlocks = NULL;
     GifFile->ExtensionBlockCount = 0;
@@ -1144,6 +1133,7 @@ DGifSlurp(GifFileType *GifFile)
 
                   GifFile->ExtensionBlocks = NULL;
                   GifFile->ExtensionBlockCount = 0;
+                  ExtensionBlockCapacity = 0;
               }
               break;
 
@@ -1152,7 +1142,8 @@ DGifSlurp(GifFileType *GifFile)
                   return (GIF_ERROR);
 	      /* Create an extension block with our data */
               if (ExtData != NULL) {
-		  if (GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+		  if (GifAddGrowingExtensionBlock(&GifFile->ExtensionBlockCount,
+					   &ExtensionBlockCapacity,
 					   &GifFile->ExtensionBlocks, 
 					   ExtFunction, ExtData[0], &ExtData[1])
 		      == GIF_ERROR)
@@ -1163,7 +1154,8 @@ DGifSlurp(GifFileType *GifFile)
                       return (GIF_ERROR);
                   /* Continue the extension block */
 		  if (ExtData != NULL)
-		      if (GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+		      if (GifAddGrowingExtensionBlock(&GifFile->ExtensionBlockCount,
+					       &ExtensionBlockCapacity,
 					       &GifFile->ExtensionBlocks,
 					       CONTINUE_EXT_FUNC_CODE, 
 					       ExtData[0], &ExtData[1]) == GIF_ERROR)
@@ -26,6 +26,26 @@ two modules will be linked.  Preserve this property!
 #include "gif_lib.h"
 #include "gif_lib_private.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EGIF_RUN_SSE2
+#endif
+
+/* Past GIF_COMPRESS_FAST a full dictionary is kept and used on, which    */
+/* decoders follow as they do not clear before told to.  The output rate   */
+/* is checked every EGIF_RATE_WINDOW pixels, and a full dictionary cleared */
+/* once a window takes 1/EGIF_RATE_SLACK more bits than the best window    */
+/* since the last clear.  GIF_COMPRESS_MAX also picks clear points among   */
+/* at most EGIF_MAX_CLEAR_POINTS evenly spaced ones.			    */
+#define EGIF_RATE_WINDOW	2048
+#define EGIF_RATE_SLACK		16
+#define EGIF_MAX_CLEAR_POINTS	32
+
+/* Bits output so far for the image being compressed: */
+#define EGIF_BITS_OUT(Private) \
+    ((Private)->CodeBufLen * 8 + (Private)->CodeAccBits)
+
 /* Masks given codes to BitsPerPixel, to make sure all codes are in range: */
 /*@+charint@*/
 static const GifPixelType CodeMask[] = {
@@ -34,12 +54,34 @@ static const GifPixelType CodeMask[] = {
 /*@-charint@*/
 
 static int EGifPutWord(int Word, GifFileType * GifFile);
+static int EGifPutColorMap(GifFileType * GifFile,
+                           const ColorMapObject * ColorMap);
 static int EGifSetupCompress(GifFileType * GifFile);
-static int EGifCompressLine(GifFileType * GifFile, GifPixelType * Line,
-                            int LineLen);
-static int EGifCompressOutput(GifFileType * GifFile, int Code);
-static int EGifBufferedOutput(GifFileType * GifFile, GifByteType * Buf,
-                              int c);
+static void EGifResetCompress(GifFilePrivateType * Private, int BitsPerPixel);
+static int EGifStartCompress(GifFilePrivateType * Private, int BitsPerPixel);
+static int EGifFinishCompress(GifFilePrivateType * Private);
+static int EGifCompressPixels(GifFilePrivateType * Private,
+                              GifPixelType * Raster, int PixelCount,
+                              const int *Clears, int ClearPoints);
+static int EGifCompressAdaptive(GifFilePrivateType * Private,
+                                GifPixelType * Line, int LineLen);
+static int EGifCheckRate(GifFilePrivateType * Private);
+static int EGifClearTable(GifFilePrivateType * Private);
+static int EGifPlanClears(GifFilePrivateType * Private,
+                          GifPixelType * Raster, int PixelCount,
+                          int BitsPerPixel, int *Clears);
+static void EGifFindNearColors(GifFilePrivateType * Private,
+                               const GifPixelType * Raster, int PixelCount);
+static int EGifCompressOutput(GifFilePrivateType * Private, int Code);
+static int EGifAppendBits(GifFilePrivateType * Private,
+                          const GifByteType * Bits, size_t BitCount);
+static int EGifPackCodeBlocks(GifFilePrivateType * Private);
+static int EGifWriteImageData(GifFileType * GifFile);
+
+/* A raster encoder is the compression part of a file being written: */
+struct GifRasterEncoder {
+    GifFilePrivateType Private;
+};
 
 /* extract bytes from an unsigned word */
 #define LOBYTE(x)	((x) & 0xff)
@@ -126,6 +168,13 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
     Private->Write = (OutputFunc) 0;    /* No user write routine (MRB) */
     GifFile->UserData = (void *)NULL;    /* No user write handle (MRB) */
 
+    Private->gif89 = false;	/* initially, write GIF87 */
+    Private->ClearCount = 0;
+    Private->CompressLevel = GIF_COMPRESS_FAST;
+    Private->LossyError = 0;
+    Private->CodeBuf = NULL;
+    Private->CodeBufLen = Private->CodeBufSize = 0;
+
     GifFile->Error = 0;
 
     return GifFile;
@@ -176,6 +225,11 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
     GifFile->UserData = userData;    /* User write handle (MRB) */
 
     Private->gif89 = false;	/* initially, write GIF87 */
+    Private->ClearCount = 0;
+    Private->CompressLevel = GIF_COMPRESS_FAST;
+    Private->LossyError = 0;
+    Private->CodeBuf = NULL;
+    Private->CodeBufLen = Private->CodeBufSize = 0;
 
     GifFile->Error = 0;
 
@@ -239,6 +293,32 @@ void EGifSetGifVersion(GifFileType *GifFile, const bool gif89)
     Private->gif89 = gif89;
 }
 
+/******************************************************************************
+ Number of times the LZW dictionary filled up and was reset while writing
+ the current image (or the last one, once it is complete).  Noisy images
+ reset it often; a high count means the compressor is doing poorly.
+******************************************************************************/
+int EGifGetClearCount(const GifFileType *GifFile)
+{
+    const GifFilePrivateType *Private =
+	(const GifFilePrivateType *) GifFile->Private;
+
+    return Private->ClearCount;
+}
+
+/******************************************************************************
+ Set how hard the encoder works on clear code placement, one of the
+ GIF_COMPRESS_* levels.  GIF_COMPRESS_MAX needs whole images, it works as
+ GIF_COMPRESS_BALANCED for images written line by line; EGifSpew and
+ EGifPutSavedImage put images that are not interlaced whole.
+******************************************************************************/
+void EGifSetCompressLevel(GifFileType *GifFile, const int Level)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    Private->CompressLevel = Level;
+}
+
 /******************************************************************************
  All writes to the GIF should go through this.
 ******************************************************************************/
@@ -292,7 +372,9 @@ EGifPutScreenDesc(GifFileType *GifFile,
     GifFile->SHeight = Height;
     GifFile->SColorResolution = ColorRes;
     GifFile->SBackGroundColor = BackGround;
-    if (ColorMap) {
+    if (ColorMap == GifFile->SColorMap) {
+        /* EGifSpew passes the map the file holds already, keep that one */
+    } else if (ColorMap) {
         GifFile->SColorMap = GifMakeMapObject(ColorMap->ColorCount,
                                            ColorMap->Colors);
         if (GifFile->SColorMap == NULL) {
@@ -325,19 +407,8 @@ EGifPutScreenDesc(GifFileType *GifFile,
     InternalWrite(GifFile, Buf, 3);
 
     /* If we have Global color map - dump it also: */
-    if (ColorMap != NULL) {
-	int i;
-        for (i = 0; i < ColorMap->ColorCount; i++) {
-            /* Put the ColorMap out also: */
-            Buf[0] = ColorMap->Colors[i].Red;
-            Buf[1] = ColorMap->Colors[i].Green;
-            Buf[2] = ColorMap->Colors[i].Blue;
-            if (InternalWrite(GifFile, Buf, 3) != 3) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-                return GIF_ERROR;
-            }
-        }
-    }
+    if (ColorMap != NULL && EGifPutColorMap(GifFile, ColorMap) == GIF_ERROR)
+        return GIF_ERROR;
 
     /* Mark this file as has screen descriptor, and no pixel written yet: */
     Private->FileState |= FILE_STATE_SCREEN;
@@ -378,17 +449,29 @@ EGifPutImageDesc(GifFileType *GifFile,
     GifFile->Image.Height = Height;
     GifFile->Image.Interlace = Interlace;
     if (ColorMap) {
-	if (GifFile->Image.ColorMap != NULL) {
-	    GifFreeMapObject(GifFile->Image.ColorMap);
-	    GifFile->Image.ColorMap = NULL;
+	if (ColorMap->ColorCount > 256) {
+	    GifFile->Error = E_GIF_ERR_DATA_TOO_BIG;
+	    return GIF_ERROR;
 	}
-        GifFile->Image.ColorMap = GifMakeMapObject(ColorMap->ColorCount,
-                                                ColorMap->Colors);
-        if (GifFile->Image.ColorMap == NULL) {
-            GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
-            return GIF_ERROR;
-        }
+	/*
+	 * The copy always has room for 256 colors, so local maps of any size
+	 * reuse it and a whole animation allocates it once:
+	 */
+	if (GifFile->Image.ColorMap == NULL) {
+	    GifFile->Image.ColorMap = GifMakeMapObject(256, NULL);
+	    if (GifFile->Image.ColorMap == NULL) {
+		GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	    }
+	}
+	memmove(GifFile->Image.ColorMap->Colors, ColorMap->Colors,
+		ColorMap->ColorCount * sizeof(GifColorType));
+	GifFile->Image.ColorMap->ColorCount = ColorMap->ColorCount;
+	GifFile->Image.ColorMap->BitsPerPixel = GifBitSize(ColorMap->ColorCount);
+	GifFile->Image.ColorMap->SortFlag = ColorMap->SortFlag;
     } else {
+	if (GifFile->Image.ColorMap != NULL)
+	    GifFreeMapObject(GifFile->Image.ColorMap);
         GifFile->Image.ColorMap = NULL;
     }
 
@@ -405,19 +488,8 @@ EGifPutImageDesc(GifFileType *GifFile,
     InternalWrite(GifFile, Buf, 1);
 
     /* If we have Global color map - dump it also: */
-    if (ColorMap != NULL) {
-	int i;
-        for (i = 0; i < ColorMap->ColorCount; i++) {
-            /* Put the ColorMap out also: */
-            Buf[0] = ColorMap->Colors[i].Red;
-            Buf[1] = ColorMap->Colors[i].Green;
-            Buf[2] = ColorMap->Colors[i].Blue;
-            if (InternalWrite(GifFile, Buf, 3) != 3) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-                return GIF_ERROR;
-            }
-        }
-    }
+    if (ColorMap != NULL && EGifPutColorMap(GifFile, ColorMap) == GIF_ERROR)
+        return GIF_ERROR;
     if (GifFile->SColorMap == NULL && GifFile->Image.ColorMap == NULL) {
         GifFile->Error = E_GIF_ERR_NO_COLOR_MAP;
         return GIF_ERROR;
@@ -428,7 +500,8 @@ EGifPutImageDesc(GifFileType *GifFile,
     Private->PixelCount = (long)Width *(long)Height;
 
     /* Reset compress algorithm parameters. */
-    (void)EGifSetupCompress(GifFile);
+    if (EGifSetupCompress(GifFile) == GIF_ERROR)
+        return GIF_ERROR;
 
     return GIF_OK;
 }
@@ -463,7 +536,15 @@ EGifPutLine(GifFileType * GifFile, GifPixelType *Line, int LineLen)
     for (i = 0; i < LineLen; i++)
         Line[i] &= Mask;
 
-    return EGifCompressLine(GifFile, Line, LineLen);
+    if ((Private->CompressLevel == GIF_COMPRESS_FAST
+         ? EGifCompressLine(Private, Line, LineLen)
+         : EGifCompressAdaptive(Private, Line, LineLen)) == GIF_ERROR
+        || (Private->PixelCount == 0
+            && EGifFinishCompress(Private) == GIF_ERROR)) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return Private->PixelCount == 0 ? EGifWriteImageData(GifFile) : GIF_OK;
 }
 
 /******************************************************************************
@@ -490,7 +571,15 @@ EGifPutPixel(GifFileType *GifFile, GifPixelType Pixel)
      * wrong code (because of overflow when we combine them) in this case: */
     Pixel &= CodeMask[Private->BitsPerPixel];
 
-    return EGifCompressLine(GifFile, &Pixel, 1);
+    if ((Private->CompressLevel == GIF_COMPRESS_FAST
+         ? EGifCompressLine(Private, &Pixel, 1)
+         : EGifCompressAdaptive(Private, &Pixel, 1)) == GIF_ERROR
+        || (Private->PixelCount == 0
+            && EGifFinishCompress(Private) == GIF_ERROR)) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return Private->PixelCount == 0 ? EGifWriteImageData(GifFile) : GIF_OK;
 }
 
 /******************************************************************************
@@ -708,14 +797,13 @@ EGifPutCode(GifFileType *GifFile, int CodeSize, const GifByteType *CodeBlock)
         return GIF_ERROR;
     }
 
-    /* No need to dump code size as Compression set up does any for us: */
-    /* 
-     * Buf = CodeSize;
-     * if (InternalWrite(GifFile, &Buf, 1) != 1) {
-     *      GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-     *      return GIF_ERROR;
-     * }
-     */
+    /* Compression set up left the code size in the code buffer, dump it
+     * alone and drop the codes behind it: */
+    if (InternalWrite(GifFile, Private->CodeBuf, 1) != 1) {
+        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        return GIF_ERROR;
+    }
+    Private->CodeBufLen = 0;
 
     return EGifPutCodeNext(GifFile, CodeBlock);
 }
@@ -749,6 +837,310 @@ EGifPutCodeNext(GifFileType *GifFile, const GifByteType *CodeBlock)
     return GIF_OK;
 }
 
+/******************************************************************************
+ Put the data of the current image, compressed beforehand by
+ EGifCompressRaster, instead of its pixels.  This routine should follow
+ EGifPutImageDesc, and the image must have been compressed for the bits per
+ pixel of the color map in use.
+******************************************************************************/
+int
+EGifPutCompressedImage(GifFileType *GifFile, const GifCompressedImage *Image)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+    if (Image->Length < 2 || Image->Bytes[0] != Private->BitsPerPixel) {
+        GifFile->Error = E_GIF_ERR_CODE_SIZE;
+        return GIF_ERROR;
+    }
+
+    /* Drop what compression set up started, the image is complete: */
+    Private->CodeBufLen = 0;
+    Private->PixelCount = 0;
+    Private->ClearCount = Image->ClearCount;
+
+    if ((size_t)InternalWrite(GifFile, Image->Bytes, Image->Length)
+        != Image->Length) {
+        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Allocate the state of an LZ compressor working apart from any file, so
+ images can be compressed on several threads at once, one encoder each.
+ The encoder keeps its dictionary from one image to the next, in a hash
+ table of over 4 MB, so encoders are worth keeping rather than remaking.
+ Returns NULL if out of memory.
+******************************************************************************/
+GifRasterEncoder *
+EGifNewRasterEncoder(void)
+{
+    GifRasterEncoder *Encoder;
+
+    Encoder = (GifRasterEncoder *)malloc(sizeof(GifRasterEncoder));
+    if (Encoder == NULL)
+        return NULL;
+    if ((Encoder->Private.HashTable = _InitHashTable()) == NULL) {
+        free(Encoder);
+        return NULL;
+    }
+    Encoder->Private.CodeBuf = NULL;
+    Encoder->Private.CodeBufLen = Encoder->Private.CodeBufSize = 0;
+    Encoder->Private.PixelCount = 0;
+    Encoder->Private.CompressLevel = GIF_COMPRESS_FAST;
+    Encoder->Private.LossyError = 0;
+
+    return Encoder;
+}
+
+void
+EGifSetEncoderCompressLevel(GifRasterEncoder *Encoder, const int Level)
+{
+    Encoder->Private.CompressLevel = Level;
+}
+
+/******************************************************************************
+ Make the encoder lossy: where the dictionary has no string for the current
+ one and the next pixel, but has one for another color at most MaxError
+ away in RGB, the string goes on with that color, so strings grow longer at
+ the cost of exact colors.  The colors are those of ColorMap, which must
+ stay valid while the images using it are compressed.  TransparentColor, or
+ NO_TRANSPARENT_COLOR, never takes nor gives its place.  A MaxError of 0
+ makes the encoder lossless again.
+******************************************************************************/
+void
+EGifSetEncoderLossy(GifRasterEncoder *Encoder,
+                    const int MaxError,
+                    const ColorMapObject *ColorMap,
+                    const int TransparentColor)
+{
+    Encoder->Private.LossyError =
+        ColorMap != NULL && MaxError > 0 ? MaxError : 0;
+    Encoder->Private.LossyColorMap = ColorMap;
+    Encoder->Private.LossyTransparent = TransparentColor;
+}
+
+void
+EGifFreeRasterEncoder(GifRasterEncoder *Encoder)
+{
+    if (Encoder != NULL) {
+        free((char *) Encoder->Private.HashTable);
+        free((char *) Encoder);
+    }
+}
+
+/******************************************************************************
+ Compress PixelCount pixels of BitsPerPixel bits from Raster into Image, as
+ the data of an image ready for EGifPutCompressedImage.  The rows go in the
+ order they are written, so those of an interlaced image go in its passes.
+ Like EGifPutLine, masks the pixels to BitsPerPixel in place.  The buffer of
+ Image is grown as needed and reused, start it zeroed.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+int
+EGifCompressRaster(GifRasterEncoder *Encoder,
+                   GifPixelType *Raster,
+                   const int PixelCount,
+                   const int BitsPerPixel,
+                   GifCompressedImage *Image)
+{
+    GifFilePrivateType *Private = &Encoder->Private;
+    GifPixelType Mask;
+    int i, Result, Clears[EGIF_MAX_CLEAR_POINTS], ClearPoints = 0;
+
+    if (PixelCount <= 0 || BitsPerPixel < 1 || BitsPerPixel > 8)
+        return GIF_ERROR;
+
+    Mask = CodeMask[BitsPerPixel < 2 ? 2 : BitsPerPixel];
+    for (i = 0; i < PixelCount; i++)
+        Raster[i] &= Mask;
+    if (Private->LossyError > 0)
+        EGifFindNearColors(Private, Raster, PixelCount);
+
+    /* Compress straight into the buffer of Image: */
+    Private->CodeBuf = Image->Bytes;
+    Private->CodeBufSize = Image->Size;
+
+    if (Private->CompressLevel == GIF_COMPRESS_MAX)
+        ClearPoints = EGifPlanClears(Private, Raster, PixelCount,
+                                     BitsPerPixel, Clears);
+    Result = EGifStartCompress(Private, BitsPerPixel);
+    if (Result == GIF_OK)
+        Result = EGifCompressPixels(Private, Raster, PixelCount,
+                                    Clears, ClearPoints);
+    if (Result == GIF_OK)
+        Result = EGifFinishCompress(Private);
+
+    Image->Bytes = Private->CodeBuf;
+    Image->Size = Private->CodeBufSize;
+    Image->Length = Result == GIF_OK ? Private->CodeBufLen : 0;
+    Image->ClearCount = Private->ClearCount;
+    Image->LossyPixels = Private->LossyPixels;
+    Private->CodeBuf = NULL;
+    Private->CodeBufLen = Private->CodeBufSize = 0;
+
+    return Result;
+}
+
+/******************************************************************************
+ Compress PixelCount pixels of BitsPerPixel bits from Raster into Strip, as
+ one of the strips an image is cut into, to compress them on several
+ threads.  The strip starts with a fresh dictionary and has no Clear code in
+ front, nor EOF code behind: EGifJoinStrips puts those in.  Masks the pixels
+ like EGifCompressRaster; the buffer of Strip is reused too.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+int
+EGifCompressStrip(GifRasterEncoder *Encoder,
+                  GifPixelType *Raster,
+                  const int PixelCount,
+                  const int BitsPerPixel,
+                  GifCodeStrip *Strip)
+{
+    GifFilePrivateType *Private = &Encoder->Private;
+    GifPixelType Mask;
+    int i, Result, Clears[EGIF_MAX_CLEAR_POINTS], ClearPoints = 0;
+
+    if (PixelCount <= 0 || BitsPerPixel < 1 || BitsPerPixel > 8)
+        return GIF_ERROR;
+
+    Mask = CodeMask[BitsPerPixel < 2 ? 2 : BitsPerPixel];
+    for (i = 0; i < PixelCount; i++)
+        Raster[i] &= Mask;
+    if (Private->LossyError > 0)
+        EGifFindNearColors(Private, Raster, PixelCount);
+
+    Private->CodeBuf = Strip->Bytes;
+    Private->CodeBufSize = Strip->Size;
+
+    if (Private->CompressLevel == GIF_COMPRESS_MAX)
+        ClearPoints = EGifPlanClears(Private, Raster, PixelCount,
+                                     BitsPerPixel, Clears);
+    EGifResetCompress(Private, BitsPerPixel);
+    Result = EGifCompressPixels(Private, Raster, PixelCount,
+                                Clears, ClearPoints);
+    if (Result == GIF_OK)
+        Result = EGifCompressOutput(Private, Private->CrntCode);
+
+    /* The code after the strip goes out at the width its last one left: */
+    Strip->BitsPerPixel = Private->BitsPerPixel;
+    Strip->EndBits = Private->RunningBits;
+    Strip->ClearCount = Private->ClearCount;
+    Strip->LossyPixels = Private->LossyPixels;
+    Strip->BitCount = 0;
+    if (Result == GIF_OK)
+        Result = EGifReserveCodes(Private, 8);
+    if (Result == GIF_OK) {
+        Strip->BitCount = Private->CodeBufLen * 8 + Private->CodeAccBits;
+        while (Private->CodeAccBits > 0) {
+            Private->CodeBuf[Private->CodeBufLen++] =
+                (GifByteType)Private->CodeAcc;
+            Private->CodeAcc >>= 8;
+            Private->CodeAccBits -= 8;
+        }
+    }
+
+    Strip->Bytes = Private->CodeBuf;
+    Strip->Size = Private->CodeBufSize;
+    Private->CodeBuf = NULL;
+    Private->CodeBufLen = Private->CodeBufSize = 0;
+
+    return Result;
+}
+
+/******************************************************************************
+ Join StripCount strips of an image, in order, into its data.  Every strip
+ is led by a Clear code, at the width the codes before it left, and the
+ last one is followed by the EOF code; the bits are then cut into
+ sub-blocks once for the whole image.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+int
+EGifJoinStrips(GifRasterEncoder *Encoder,
+               const GifCodeStrip *Strips,
+               const int StripCount,
+               GifCompressedImage *Image)
+{
+    GifFilePrivateType *Private = &Encoder->Private;
+    GifByteType Code[2];
+    int i, Bits, Result = GIF_OK;
+
+    if (StripCount <= 0)
+        return GIF_ERROR;
+    for (i = 1; i < StripCount; i++)
+        if (Strips[i].BitsPerPixel != Strips[0].BitsPerPixel)
+            return GIF_ERROR;
+
+    Private->CodeBuf = Image->Bytes;
+    Private->CodeBufSize = Image->Size;
+    EGifResetCompress(Private, Strips[0].BitsPerPixel);
+
+    if (EGifReserveCodes(Private, 1) == GIF_ERROR)
+        Result = GIF_ERROR;
+    else
+        Private->CodeBuf[Private->CodeBufLen++] =
+            (GifByteType)Private->BitsPerPixel;
+
+    Bits = Private->RunningBits;
+    Code[0] = LOBYTE(Private->ClearCode);
+    Code[1] = HIBYTE(Private->ClearCode);
+    for (i = 0; i < StripCount && Result == GIF_OK; i++) {
+        if (EGifAppendBits(Private, Code, Bits) == GIF_ERROR
+            || EGifAppendBits(Private, Strips[i].Bytes,
+                              Strips[i].BitCount) == GIF_ERROR)
+            Result = GIF_ERROR;
+        Bits = Strips[i].EndBits;
+        Private->ClearCount += Strips[i].ClearCount + (i > 0);
+        Private->LossyPixels += Strips[i].LossyPixels;
+    }
+
+    Code[0] = LOBYTE(Private->EOFCode);
+    Code[1] = HIBYTE(Private->EOFCode);
+    if (Result == GIF_OK
+        && (EGifAppendBits(Private, Code, Bits) == GIF_ERROR
+            || EGifCompressOutput(Private, FLUSH_OUTPUT) == GIF_ERROR))
+        Result = GIF_ERROR;
+
+    Image->Bytes = Private->CodeBuf;
+    Image->Size = Private->CodeBufSize;
+    Image->Length = Result == GIF_OK ? Private->CodeBufLen : 0;
+    Image->ClearCount = Private->ClearCount;
+    Image->LossyPixels = Private->LossyPixels;
+    Private->CodeBuf = NULL;
+    Private->CodeBufLen = Private->CodeBufSize = 0;
+
+    return Result;
+}
+
+/******************************************************************************
+ Free the buffer of a strip, and leave it empty for reuse.
+******************************************************************************/
+void
+EGifFreeCodeStrip(GifCodeStrip *Strip)
+{
+    free((char *) Strip->Bytes);
+    Strip->Bytes = NULL;
+    Strip->BitCount = Strip->Size = 0;
+}
+
+/******************************************************************************
+ Free the buffer of a compressed image, and leave it empty for reuse.
+******************************************************************************/
+void
+EGifFreeCompressedImage(GifCompressedImage *Image)
+{
+    free((char *) Image->Bytes);
+    Image->Bytes = NULL;
+    Image->Length = Image->Size = 0;
+    Image->ClearCount = 0;
+}
+
 /******************************************************************************
  This routine should be called last, to close the GIF file.
 ******************************************************************************/
@@ -790,6 +1182,7 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
         if (Private->HashTable) {
             free((char *) Private->HashTable);
         }
+        free((char *) Private->CodeBuf);
 	free((char *) Private);
     }
 
@@ -822,6 +1215,27 @@ EGifPutWord(int Word, GifFileType *GifFile)
         return GIF_ERROR;
 }
 
+/******************************************************************************
+ Put the colors of ColorMap out in one write, not one per color:
+******************************************************************************/
+static int
+EGifPutColorMap(GifFileType *GifFile, const ColorMapObject *ColorMap)
+{
+    GifByteType Buf[3 * 256];
+    int i, Len = 0;
+
+    for (i = 0; i < ColorMap->ColorCount && i < 256; i++) {
+        Buf[Len++] = ColorMap->Colors[i].Red;
+        Buf[Len++] = ColorMap->Colors[i].Green;
+        Buf[Len++] = ColorMap->Colors[i].Blue;
+    }
+    if (InternalWrite(GifFile, Buf, Len) != Len) {
+        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
 /******************************************************************************
  Setup the LZ compression for this image:
 ******************************************************************************/
@@ -829,7 +1243,6 @@ static int
 EGifSetupCompress(GifFileType *GifFile)
 {
     int BitsPerPixel;
-    GifByteType Buf;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
     /* Test and see what color map to use, and from it # bits per pixel: */
@@ -842,10 +1255,23 @@ EGifSetupCompress(GifFileType *GifFile)
         return GIF_ERROR;
     }
 
-    Buf = BitsPerPixel = (BitsPerPixel < 2 ? 2 : BitsPerPixel);
-    InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
+    if (EGifStartCompress(Private, BitsPerPixel) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Reset the LZ compression state for pixels of BitsPerPixel bits, with an
+ empty code buffer.
+******************************************************************************/
+static void
+EGifResetCompress(GifFilePrivateType *Private, int BitsPerPixel)
+{
+    BitsPerPixel = (BitsPerPixel < 2 ? 2 : BitsPerPixel);
 
-    Private->Buf[0] = 0;    /* Nothing was output yet. */
+    Private->CodeBufLen = 0;    /* Nothing was output yet. */
     Private->BitsPerPixel = BitsPerPixel;
     Private->ClearCode = (1 << BitsPerPixel);
     Private->EOFCode = Private->ClearCode + 1;
@@ -853,144 +1279,406 @@ EGifSetupCompress(GifFileType *GifFile)
     Private->RunningBits = BitsPerPixel + 1;    /* Number of bits per code. */
     Private->MaxCode1 = 1 << Private->RunningBits;    /* Max. code + 1. */
     Private->CrntCode = FIRST_CODE;    /* Signal that this is first one! */
-    Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
-    Private->CrntShiftDWord = 0;
+    Private->CodeAccBits = 0;    /* No information in CodeAcc. */
+    Private->CodeAcc = 0;
 
-   /* Clear hash table and send Clear to make sure the decoder do the same. */
     _ClearHashTable(Private->HashTable);
+    Private->ClearCount = 0;
+    Private->LossyPixels = 0;
 
-    if (EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
-        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+    Private->WindowLeft = EGIF_RATE_WINDOW;
+    Private->WindowStartBits = 0;
+    Private->BestWindowBits = (size_t)-1;
+}
+
+/******************************************************************************
+ Start the LZ compression of an image of BitsPerPixel bits pixels.
+ The code size goes first into the code buffer, so the whole image data is
+ written at once when the image is complete.
+******************************************************************************/
+static int
+EGifStartCompress(GifFilePrivateType *Private, int BitsPerPixel)
+{
+    EGifResetCompress(Private, BitsPerPixel);
+
+    if (EGifReserveCodes(Private, 1) == GIF_ERROR)
         return GIF_ERROR;
-    }
-    return GIF_OK;
+    Private->CodeBuf[Private->CodeBufLen++] =
+        (GifByteType)Private->BitsPerPixel;
+
+    /* Send Clear to make sure the decoder clears its table the same. */
+    return EGifCompressOutput(Private, Private->ClearCode);
 }
 
 /******************************************************************************
- The LZ compression routine:
- This version compresses the given buffer Line of length LineLen.
- This routine can be called a few times (one per scan line, for example), in
- order to complete the whole image.
+ Once all the pixels are in, output the last code and flush, so the code
+ buffer holds the complete data of the image.
 ******************************************************************************/
 static int
-EGifCompressLine(GifFileType *GifFile,
-                 GifPixelType *Line,
-                 const int LineLen)
+EGifFinishCompress(GifFilePrivateType *Private)
 {
-    int i = 0, CrntCode, NewCode;
-    unsigned long NewKey;
-    GifPixelType Pixel;
-    GifHashTableType *HashTable;
-    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    /* We are done - output last Code and flush output buffers: */
+    if (Private->CrntCode != FIRST_CODE
+        && EGifCompressOutput(Private, Private->CrntCode) == GIF_ERROR)
+        return GIF_ERROR;
+    if (EGifCompressOutput(Private, Private->EOFCode) == GIF_ERROR)
+        return GIF_ERROR;
+    return EGifCompressOutput(Private, FLUSH_OUTPUT);
+}
 
-    HashTable = Private->HashTable;
+/******************************************************************************
+ Compress the PixelCount pixels of a whole image the way CompressLevel asks.
+ Clears holds the ClearPoints points EGifPlanClears picked, in order, where
+ the dictionary is cleared before going on.  Private->PixelCount is kept
+ as the pixels still to come, as when the image is written line by line.
+******************************************************************************/
+static int
+EGifCompressPixels(GifFilePrivateType *Private,
+                   GifPixelType *Raster,
+                   int PixelCount,
+                   const int *Clears,
+                   int ClearPoints)
+{
+    int i, Done = 0;
 
-    if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
-        CrntCode = Line[i++];
-    else
-        CrntCode = Private->CrntCode;    /* Get last code in compression. */
-
-    while (i < LineLen) {   /* Decode LineLen items. */
-        Pixel = Line[i++];  /* Get next pixel from stream. */
-        /* Form a new unique key to search hash table for the code combines 
-         * CrntCode as Prefix string with Pixel as postfix char.
-         */
-        NewKey = (((uint32_t) CrntCode) << 8) + Pixel;
-        if ((NewCode = _ExistsHashTable(HashTable, NewKey)) >= 0) {
-            /* This Key is already there, or the string is old one, so
-             * simple take new code as our CrntCode:
-             */
-            CrntCode = NewCode;
-        } else {
-            /* Put it in hash table, output the prefix code, and make our
-             * CrntCode equal to Pixel.
-             */
-            if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
-                GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-                return GIF_ERROR;
-            }
-            CrntCode = Pixel;
-
-            /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
-             */
-            if (Private->RunningCode >= LZ_MAX_CODE) {
-                /* Time to do some clearance: */
-                if (EGifCompressOutput(GifFile, Private->ClearCode)
-                        == GIF_ERROR) {
-                    GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-                    return GIF_ERROR;
-                }
-                Private->RunningCode = Private->EOFCode + 1;
-                Private->RunningBits = Private->BitsPerPixel + 1;
-                Private->MaxCode1 = 1 << Private->RunningBits;
-                _ClearHashTable(HashTable);
-            } else {
-                /* Put this unique key with its relative Code in hash table: */
-                _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
-            }
-        }
+    if (Private->CompressLevel == GIF_COMPRESS_FAST)
+        return EGifCompressLine(Private, Raster, PixelCount);
 
+    for (i = 0; i < ClearPoints; i++) {
+        Private->PixelCount = PixelCount - Clears[i];
+        if (EGifCompressAdaptive(Private, Raster + Done,
+                                 Clears[i] - Done) == GIF_ERROR
+            || EGifClearTable(Private) == GIF_ERROR)
+            return GIF_ERROR;
+        Done = Clears[i];
     }
+    Private->PixelCount = 0;
+    return EGifCompressAdaptive(Private, Raster + Done, PixelCount - Done);
+}
 
-    /* Preserve the current state of the compression algorithm: */
-    Private->CrntCode = CrntCode;
+/******************************************************************************
+ Compress Line of length LineLen, checking the output rate at the end of
+ every window of EGIF_RATE_WINDOW pixels.  Windows go on across calls, so
+ an image written line by line is checked the same as a whole one.
+******************************************************************************/
+static int
+EGifCompressAdaptive(GifFilePrivateType *Private,
+                     GifPixelType *Line,
+                     int LineLen)
+{
+    int n;
 
-    if (Private->PixelCount == 0) {
-        /* We are done - output last Code and flush output buffers: */
-        if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+    while (LineLen > 0) {
+        n = LineLen < Private->WindowLeft ? LineLen : Private->WindowLeft;
+        if (EGifCompressLine(Private, Line, n) == GIF_ERROR)
             return GIF_ERROR;
+        Line += n;
+        LineLen -= n;
+
+        if ((Private->WindowLeft -= n) == 0) {
+            Private->WindowLeft = EGIF_RATE_WINDOW;
+            /* No point in a clear when no pixel is left: */
+            if ((LineLen > 0 || Private->PixelCount > 0)
+                && EGifCheckRate(Private) == GIF_ERROR)
+                return GIF_ERROR;
         }
-        if (EGifCompressOutput(GifFile, Private->EOFCode) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-            return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ A window of pixels is done: clear a full dictionary once the window took
+ notably more bits than the best one since the last clear, as the strings
+ it holds then fit the image no more.
+******************************************************************************/
+static int
+EGifCheckRate(GifFilePrivateType *Private)
+{
+    size_t Bits = EGIF_BITS_OUT(Private),
+        WindowBits = Bits - Private->WindowStartBits;
+
+    Private->WindowStartBits = Bits;
+
+    if (WindowBits < Private->BestWindowBits)
+        Private->BestWindowBits = WindowBits;
+    else if (Private->RunningCode >= LZ_MAX_CODE
+             && WindowBits > Private->BestWindowBits
+                             + Private->BestWindowBits / EGIF_RATE_SLACK)
+        return EGifClearTable(Private);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Clear the dictionary out of turn: output the current string, then a Clear,
+ and start the next string afresh.  Decoders add one more string for the
+ last code, so the Clear is still sent in the current code size.  The rate
+ windows start over with the new dictionary.
+******************************************************************************/
+static int
+EGifClearTable(GifFilePrivateType *Private)
+{
+    if (Private->CrntCode != FIRST_CODE
+        && EGifCompressOutput(Private, Private->CrntCode) == GIF_ERROR)
+        return GIF_ERROR;
+    if (EGifCompressOutput(Private, Private->ClearCode) == GIF_ERROR)
+        return GIF_ERROR;
+
+    Private->RunningCode = Private->EOFCode + 1;
+    Private->RunningBits = Private->BitsPerPixel + 1;
+    Private->MaxCode1 = 1 << Private->RunningBits;
+    Private->CrntCode = FIRST_CODE;
+    _ClearHashTable(Private->HashTable);
+    Private->ClearCount++;
+
+    Private->WindowLeft = EGIF_RATE_WINDOW;
+    Private->WindowStartBits = EGIF_BITS_OUT(Private);
+    Private->BestWindowBits = (size_t)-1;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Pick where to clear the dictionary in Raster for GIF_COMPRESS_MAX, on top
+ of the clears of EGifCheckRate.  The raster is cut at up to
+ EGIF_MAX_CLEAR_POINTS evenly spaced points, and every stretch between two
+ points is compressed from a fresh dictionary at its start, which gives its
+ cost in bits.  The cheapest chain of stretches is then found by dynamic
+ programming; as the chain of one stretch is GIF_COMPRESS_BALANCED, this
+ never does worse.  It takes up to about half as many passes over the
+ raster as there are points.
+   The points picked go into Clears, and their count is returned.  The code
+ buffer holds nothing of use afterwards.
+******************************************************************************/
+static int
+EGifPlanClears(GifFilePrivateType *Private,
+               GifPixelType *Raster,
+               int PixelCount,
+               int BitsPerPixel,
+               int *Clears)
+{
+    size_t Cost[EGIF_MAX_CLEAR_POINTS + 1], Trial;
+    int Point[EGIF_MAX_CLEAR_POINTS + 1], From[EGIF_MAX_CLEAR_POINTS + 1];
+    int Stretches, Spacing, a, b, ClearPoints;
+
+    Spacing = (PixelCount + EGIF_MAX_CLEAR_POINTS - 1) / EGIF_MAX_CLEAR_POINTS;
+    if (Spacing < EGIF_RATE_WINDOW)
+        Spacing = EGIF_RATE_WINDOW;
+    Stretches = (PixelCount + Spacing - 1) / Spacing;
+    if (Stretches < 2)
+        return 0;
+
+    for (b = 0; b <= Stretches; b++) {
+        Point[b] = b < Stretches ? b * Spacing : PixelCount;
+        Cost[b] = b == 0 ? 0 : (size_t)-1;
+        From[b] = 0;
+    }
+
+    /* Every stretch from Point[a] on, with the Clear and last code it ends
+     * with; a trial that failed to grow the buffer just leaves it out: */
+    for (a = 0; a < Stretches; a++) {
+        if (Cost[a] == (size_t)-1)
+            continue;
+        EGifResetCompress(Private, BitsPerPixel);
+        for (b = a + 1; b <= Stretches; b++) {
+            Private->PixelCount = PixelCount - Point[b];
+            if (EGifCompressAdaptive(Private, Raster + Point[b - 1],
+                                     Point[b] - Point[b - 1]) == GIF_ERROR)
+                break;
+            Trial = Cost[a] + EGIF_BITS_OUT(Private)
+                    + 2 * Private->RunningBits;
+            if (Trial < Cost[b]) {
+                Cost[b] = Trial;
+                From[b] = a;
+            }
         }
-        if (EGifCompressOutput(GifFile, FLUSH_OUTPUT) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-            return GIF_ERROR;
+    }
+
+    /* Walk the cheapest chain back from the end, then put it in order: */
+    ClearPoints = 0;
+    for (b = From[Stretches]; b > 0; b = From[b])
+        Clears[ClearPoints++] = Point[b];
+    for (a = 0, b = ClearPoints - 1; a < b; a++, b--) {
+        int Swap = Clears[a];
+        Clears[a] = Clears[b];
+        Clears[b] = Swap;
+    }
+    return ClearPoints;
+}
+
+/******************************************************************************
+ Fill the near colors of every pixel value in Raster, for a lossy encoder:
+ the other values of Raster whose colors are at most LossyError away, up to
+ LOSSY_NEAR_COLORS of them, nearest first.  Only values the raster holds
+ can be in the dictionary, the rest of the color map is left out, which
+ also keeps the unused black tail of a color map from filling the lists.
+******************************************************************************/
+static void
+EGifFindNearColors(GifFilePrivateType *Private,
+                   const GifPixelType *Raster,
+                   int PixelCount)
+{
+    const GifColorType *Colors = Private->LossyColorMap->Colors;
+    GifByteType Used[256];
+    int Distances[LOSSY_NEAR_COLORS];
+    int i, j, k, n, Red, Green, Blue, Distance, MaxDistance, ColorCount;
+
+    memset(Used, 0, sizeof(Used));
+    for (i = 0; i < PixelCount; i++)
+        Used[Raster[i]] = 1;
+    memset(Private->LossyNearCount, 0, sizeof(Private->LossyNearCount));
+
+    ColorCount = Private->LossyColorMap->ColorCount;
+    if (ColorCount > 256)
+        ColorCount = 256;
+    if (Private->LossyTransparent >= 0
+        && Private->LossyTransparent < ColorCount)
+        Used[Private->LossyTransparent] = 0;
+    MaxDistance = Private->LossyError * Private->LossyError;
+
+    for (i = 0; i < ColorCount; i++) {
+        if (!Used[i])
+            continue;
+        for (j = 0, n = 0; j < ColorCount; j++) {
+            if (!Used[j] || j == i)
+                continue;
+            Red = Colors[i].Red - Colors[j].Red;
+            Green = Colors[i].Green - Colors[j].Green;
+            Blue = Colors[i].Blue - Colors[j].Blue;
+            Distance = Red * Red + Green * Green + Blue * Blue;
+            if (Distance > MaxDistance
+                || (n == LOSSY_NEAR_COLORS && Distance >= Distances[n - 1]))
+                continue;
+            /* Sort it in, the farthest one drops out of a full list: */
+            for (k = n < LOSSY_NEAR_COLORS ? n++ : n - 1;
+                 k > 0 && Distances[k - 1] > Distance; k--) {
+                Distances[k] = Distances[k - 1];
+                Private->LossyNear[i][k] = Private->LossyNear[i][k - 1];
+            }
+            Distances[k] = Distance;
+            Private->LossyNear[i][k] = (GifPixelType)j;
         }
+        Private->LossyNearCount[i] = (GifByteType)n;
+    }
+}
+
+/******************************************************************************
+ Make room in the code buffer for Bytes more bytes.  It grows by doubling,
+ and is kept from one image to the next, so it soon stops growing.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+int
+EGifReserveCodes(GifFilePrivateType *Private, size_t Bytes)
+{
+    size_t Size = Private->CodeBufSize != 0 ? Private->CodeBufSize : 4096;
+    GifByteType *CodeBuf;
+
+    if (Private->CodeBufLen + Bytes <= Private->CodeBufSize)
+        return GIF_OK;
+    while (Size < Private->CodeBufLen + Bytes)
+        Size *= 2;
+    CodeBuf = (GifByteType *)realloc(Private->CodeBuf, Size);
+    if (CodeBuf == NULL)
+        return GIF_ERROR;
+    Private->CodeBuf = CodeBuf;
+    Private->CodeBufSize = Size;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Append BitCount bits, low bits first, to the codes output so far.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+static int
+EGifAppendBits(GifFilePrivateType *Private,
+               const GifByteType *Bits,
+               size_t BitCount)
+{
+    size_t i, Bytes = BitCount >> 3;
+    int Rest = (int)(BitCount & 7);
+    GifByteType *Out;
+
+    if (EGifReserveCodes(Private, Bytes + 8) == GIF_ERROR)
+        return GIF_ERROR;
+    Out = Private->CodeBuf + Private->CodeBufLen;
+
+    /* Down to less than a byte in the accumulator, then 32 bits at once: */
+    while (Private->CodeAccBits >= 8) {
+        *Out++ = (GifByteType)Private->CodeAcc;
+        Private->CodeAcc >>= 8;
+        Private->CodeAccBits -= 8;
+    }
+    for (i = 0; i + 4 <= Bytes; i += 4) {
+        Private->CodeAcc |= ((uint64_t)Bits[i] | (uint64_t)Bits[i + 1] << 8
+                             | (uint64_t)Bits[i + 2] << 16
+                             | (uint64_t)Bits[i + 3] << 24)
+                            << Private->CodeAccBits;
+        Out[0] = (GifByteType)Private->CodeAcc;
+        Out[1] = (GifByteType)(Private->CodeAcc >> 8);
+        Out[2] = (GifByteType)(Private->CodeAcc >> 16);
+        Out[3] = (GifByteType)(Private->CodeAcc >> 24);
+        Out += 4;
+        Private->CodeAcc >>= 32;
+    }
+    for (; i < Bytes; i++) {
+        Private->CodeAcc |= (uint64_t)Bits[i] << Private->CodeAccBits;
+        *Out++ = (GifByteType)Private->CodeAcc;
+        Private->CodeAcc >>= 8;
+    }
+    if (Rest > 0) {
+        Private->CodeAcc |= (uint64_t)(Bits[Bytes] & ((1 << Rest) - 1))
+                            << Private->CodeAccBits;
+        Private->CodeAccBits += Rest;
     }
 
+    Private->CodeBufLen = Out - Private->CodeBuf;
     return GIF_OK;
 }
 
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
- 8 bits (bytes) packets.
- Returns GIF_OK if written successfully.
+ 8 bits (bytes) packets.  Codes are gathered in a 64 bits accumulator and
+ stored into the code buffer 32 bits at a time; the buffer is only cut
+ into sub-blocks once the image is complete (FLUSH_OUTPUT).
+ Returns GIF_OK if succeeded.
 ******************************************************************************/
 static int
-EGifCompressOutput(GifFileType *GifFile,
+EGifCompressOutput(GifFilePrivateType *Private,
                    const int Code)
 {
-    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifByteType *Out;
     int retval = GIF_OK;
 
     if (Code == FLUSH_OUTPUT) {
-        while (Private->CrntShiftState > 0) {
-            /* Get Rid of what is left in DWord, and flush it. */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
-            Private->CrntShiftDWord >>= 8;
-            Private->CrntShiftState -= 8;
+        /* Get Rid of what is left in the accumulator, and pack it all: */
+        if (EGifReserveCodes(Private, 8) == GIF_ERROR)
+            return GIF_ERROR;
+        Out = Private->CodeBuf + Private->CodeBufLen;
+        while (Private->CodeAccBits > 0) {
+            *Out++ = (GifByteType)Private->CodeAcc;
+            Private->CodeAcc >>= 8;
+            Private->CodeAccBits -= 8;
         }
-        Private->CrntShiftState = 0;    /* For next time. */
-        if (EGifBufferedOutput(GifFile, Private->Buf,
-                               FLUSH_OUTPUT) == GIF_ERROR)
-            retval = GIF_ERROR;
+        Private->CodeBufLen = Out - Private->CodeBuf;
+        Private->CodeAcc = 0;    /* For next time. */
+        Private->CodeAccBits = 0;
+        retval = EGifPackCodeBlocks(Private);
     } else {
-        Private->CrntShiftDWord |= ((long)Code) << Private->CrntShiftState;
-        Private->CrntShiftState += Private->RunningBits;
-        while (Private->CrntShiftState >= 8) {
-            /* Dump out full bytes: */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
-            Private->CrntShiftDWord >>= 8;
-            Private->CrntShiftState -= 8;
+        Private->CodeAcc |= ((uint64_t)Code) << Private->CodeAccBits;
+        Private->CodeAccBits += Private->RunningBits;
+        if (Private->CodeAccBits >= 32) {
+            /* Dump out four full bytes: */
+            if (Private->CodeBufLen + 4 > Private->CodeBufSize
+                && EGifReserveCodes(Private, 4) == GIF_ERROR)
+                return GIF_ERROR;
+            Out = Private->CodeBuf + Private->CodeBufLen;
+            Out[0] = (GifByteType)Private->CodeAcc;
+            Out[1] = (GifByteType)(Private->CodeAcc >> 8);
+            Out[2] = (GifByteType)(Private->CodeAcc >> 16);
+            Out[3] = (GifByteType)(Private->CodeAcc >> 24);
+            Private->CodeBufLen += 4;
+            Private->CodeAcc >>= 32;
+            Private->CodeAccBits -= 32;
         }
     }
 
@@ -1004,44 +1692,216 @@ EGifCompressOutput(GifFileType *GifFile,
 }
 
 /******************************************************************************
- This routines buffers the given characters until 255 characters are ready
- to be output. If Code is equal to -1 the buffer is flushed (EOF).
- The buffer is Dumped with first byte as its size, as GIF format requires.
- Returns GIF_OK if written successfully.
+ Cut the codes of an image, which follow the code size in the code buffer,
+ into GIF data sub-blocks, each led by its size, up to 255 bytes, and ended
+ by an empty block (see GIF doc).  The size bytes are inserted in place,
+ moving the blocks apart from the last one down, so the image data can go
+ out in a single write.
+ Returns GIF_OK if succeeded.
 ******************************************************************************/
 static int
-EGifBufferedOutput(GifFileType *GifFile,
-                   GifByteType *Buf,
-                   int c)
+EGifPackCodeBlocks(GifFilePrivateType *Private)
 {
-    if (c == FLUSH_OUTPUT) {
-        /* Flush everything out. */
-        if (Buf[0] != 0
-            && InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-            return GIF_ERROR;
-        }
-        /* Mark end of compressed data, by an empty block (see GIF doc): */
-        Buf[0] = 0;
-        if (InternalWrite(GifFile, Buf, 1) != 1) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-            return GIF_ERROR;
-        }
-    } else {
-        if (Buf[0] == 255) {
-            /* Dump out this buffer - it is full: */
-            if (InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-                return GIF_ERROR;
-            }
-            Buf[0] = 0;
-        }
-        Buf[++Buf[0]] = c;
+    size_t Len = Private->CodeBufLen - 1, NumBlocks = (Len + 254) / 255,
+           Src = Len + 1, Dst = Src + NumBlocks, BlockLen;
+    GifByteType *Buf;
+
+    if (EGifReserveCodes(Private, NumBlocks + 1) == GIF_ERROR)
+        return GIF_ERROR;
+    Buf = Private->CodeBuf;
+
+    Private->CodeBufLen = Dst + 1;
+    Buf[Dst] = 0;
+    for (BlockLen = Len - (NumBlocks - 1) * 255; Src > 1; BlockLen = 255) {
+        Src -= BlockLen;
+        Dst -= BlockLen;
+        memmove(Buf + Dst, Buf + Src, BlockLen);
+        Buf[--Dst] = (GifByteType)BlockLen;
     }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Write the complete data of the image in the code buffer to the file.
+******************************************************************************/
+static int
+EGifWriteImageData(GifFileType *GifFile)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    size_t Len = Private->CodeBufLen;
 
+    Private->CodeBufLen = 0;
+    if ((size_t)InternalWrite(GifFile, Private->CodeBuf, Len) != Len) {
+        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        return GIF_ERROR;
+    }
     return GIF_OK;
 }
 
+/******************************************************************************
+ First column in [From, To) of row Offset where any of the planes differ,
+ To if none does.  Blocks of 16 are compared at once; the scalar loop then
+ finds the column in the block that differs, and does the tail.
+******************************************************************************/
+static int
+EGifFirstChange(const GifByteType *const *Previous,
+                const GifByteType *const *Current,
+                int PlaneCount, size_t Offset, int From, int To)
+{
+    int x = From, p;
+#ifdef EGIF_RUN_SSE2
+    for (; x + 16 <= To; x += 16) {
+        __m128i Same = _mm_set1_epi8(-1);
+        for (p = 0; p < PlaneCount; p++)
+            Same = _mm_and_si128(Same, _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(Previous[p] + Offset + x)),
+                _mm_loadu_si128((const __m128i *)(Current[p] + Offset + x))));
+        if (_mm_movemask_epi8(Same) != 0xFFFF)
+            break;
+    }
+#endif /* EGIF_RUN_SSE2 */
+
+    for (; x < To; x++)
+        for (p = 0; p < PlaneCount; p++)
+            if (Previous[p][Offset + x] != Current[p][Offset + x])
+                return x;
+    return To;
+}
+
+/******************************************************************************
+ Last column in [From, To) of row Offset where any of the planes differ,
+ From - 1 if none does.  Same as EGifFirstChange, from the right.
+******************************************************************************/
+static int
+EGifLastChange(const GifByteType *const *Previous,
+               const GifByteType *const *Current,
+               int PlaneCount, size_t Offset, int From, int To)
+{
+    int x = To, p;
+#ifdef EGIF_RUN_SSE2
+    for (; x - 16 >= From; x -= 16) {
+        __m128i Same = _mm_set1_epi8(-1);
+        for (p = 0; p < PlaneCount; p++)
+            Same = _mm_and_si128(Same, _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(Previous[p] + Offset + x - 16)),
+                _mm_loadu_si128((const __m128i *)(Current[p] + Offset + x - 16))));
+        if (_mm_movemask_epi8(Same) != 0xFFFF)
+            break;
+    }
+#endif /* EGIF_RUN_SSE2 */
+
+    for (x--; x >= From; x--)
+        for (p = 0; p < PlaneCount; p++)
+            if (Previous[p][Offset + x] != Current[p][Offset + x])
+                return x;
+    return From - 1;
+}
+
+/******************************************************************************
+ Find the smallest rectangle holding every pixel that differs between two
+ frames of Width by Height, each made of PlaneCount planes, such as the
+ red, green and blue channels or a single plane of color indexes.  Only
+ the rectangle has to be written for the second frame, over the first one
+ left in place with DISPOSE_DO_NOT.
+   The Left, Top, Width and Height of Rect are set, to an empty rectangle
+ if the frames are the same.  This function returns true if they differ.
+******************************************************************************/
+bool
+EGifChangedRect(int Width, int Height, int PlaneCount,
+                const GifByteType *const *Previous,
+                const GifByteType *const *Current,
+                GifImageDesc *Rect)
+{
+    int Top, Bottom, Left, Right, y;
+
+    Rect->Left = Rect->Top = Rect->Width = Rect->Height = 0;
+
+    /* Rows that do not change at all, from the top and from the bottom: */
+    for (Top = 0; Top < Height; Top++)
+        if (EGifFirstChange(Previous, Current, PlaneCount,
+                            (size_t)Top * Width, 0, Width) < Width)
+            break;
+    if (Top == Height)
+        return false;
+    for (Bottom = Height - 1; Bottom > Top; Bottom--)
+        if (EGifFirstChange(Previous, Current, PlaneCount,
+                            (size_t)Bottom * Width, 0, Width) < Width)
+            break;
+
+    /* Then every row in between only has to be searched outside the
+     * columns known to change already, which return as is if none does: */
+    Left = Width;
+    Right = -1;
+    for (y = Top; y <= Bottom && (Left > 0 || Right < Width - 1); y++) {
+        Left = EGifFirstChange(Previous, Current, PlaneCount,
+                               (size_t)y * Width, 0, Left);
+        Right = EGifLastChange(Previous, Current, PlaneCount,
+                               (size_t)y * Width, Right + 1, Width);
+    }
+
+    Rect->Left = Left;
+    Rect->Top = Top;
+    Rect->Width = Right - Left + 1;
+    Rect->Height = Bottom - Top + 1;
+    return true;
+}
+
+/******************************************************************************
+ Count the pixels of two images of PixelCount pixels, each made of
+ PlaneCount planes, that differ by more than Tolerance in any plane.  The
+ count stops early once it is past Limit, as a caller asking whether the
+ images are alike within Limit pixels needs no more, so then any count
+ above Limit may be returned.  Tolerance is taken from 0 to 255.
+******************************************************************************/
+int
+EGifCountChanges(int PixelCount, int PlaneCount,
+                 const GifByteType *const *Previous,
+                 const GifByteType *const *Current,
+                 int Tolerance, int Limit)
+{
+    int i = 0, p, Count = 0;
+#ifdef EGIF_RUN_SSE2
+    __m128i Bound;
+    int Changed;
+#endif /* EGIF_RUN_SSE2 */
+
+    /* The blocks compare bytes, the tail must see the same bound: */
+    if (Tolerance < 0)
+        Tolerance = 0;
+    else if (Tolerance > 255)
+        Tolerance = 255;
+
+#ifdef EGIF_RUN_SSE2
+    Bound = _mm_set1_epi8((char)Tolerance);
+
+    /* |a - b| as the sum of the two saturated differences, and it is
+     * within Tolerance where max(|a - b|, Tolerance) is Tolerance: */
+    for (; i + 16 <= PixelCount && Count <= Limit; i += 16) {
+        __m128i Same = _mm_set1_epi8(-1);
+        for (p = 0; p < PlaneCount; p++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(Previous[p] + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(Current[p] + i));
+            __m128i Diff = _mm_or_si128(_mm_subs_epu8(a, b),
+                                        _mm_subs_epu8(b, a));
+            Same = _mm_and_si128(Same, _mm_cmpeq_epi8(
+                _mm_max_epu8(Diff, Bound), Bound));
+        }
+        for (Changed = ~_mm_movemask_epi8(Same) & 0xFFFF; Changed != 0;
+             Changed &= Changed - 1)
+            Count++;
+    }
+#endif /* EGIF_RUN_SSE2 */
+
+    for (; i < PixelCount && Count <= Limit; i++)
+        for (p = 0; p < PlaneCount; p++)
+            if (Previous[p][i] - Current[p][i] > Tolerance
+                || Current[p][i] - Previous[p][i] > Tolerance) {
+                Count++;
+                break;
+            }
+    return Count;
+}
+
 /******************************************************************************
  This routine writes to disk an in-core representation of a GIF previously
  created by DGifSlurp().
@@ -1072,80 +1932,163 @@ EGifWriteExtensions(GifFileType *GifFileOut,
     return (GIF_OK);
 }
 
+/******************************************************************************
+ Put the whole raster of the image EGifPutImageDesc started at once, for
+ GIF_COMPRESS_MAX: the clear points are planned over all of it first, as in
+ EGifCompressRaster, which gives the same image data.  Masks the pixels in
+ place like EGifPutLine.
+******************************************************************************/
+static int
+EGifPutRaster(GifFileType *GifFile, GifPixelType *Raster, int PixelCount)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    int i, BitsPerPixel = Private->BitsPerPixel,
+        Clears[EGIF_MAX_CLEAR_POINTS], ClearPoints;
+    GifPixelType Mask;
+
+    if (Private->PixelCount != (unsigned long)PixelCount) {
+        GifFile->Error = E_GIF_ERR_DATA_TOO_BIG;
+        return GIF_ERROR;
+    }
+    Mask = CodeMask[BitsPerPixel];
+    for (i = 0; i < PixelCount; i++)
+        Raster[i] &= Mask;
+
+    /* The plan uses the code buffer, the image is started over after it: */
+    ClearPoints = EGifPlanClears(Private, Raster, PixelCount, BitsPerPixel,
+                                 Clears);
+    if (EGifStartCompress(Private, BitsPerPixel) == GIF_ERROR
+        || EGifCompressPixels(Private, Raster, PixelCount,
+                              Clears, ClearPoints) == GIF_ERROR
+        || EGifFinishCompress(Private) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return EGifWriteImageData(GifFile);
+}
+
+/******************************************************************************
+ Write one in-core image: its extension blocks, its image descriptor and its
+ raster.  If Compressed is not NULL it holds the image data already, as made
+ by EGifCompressRaster, else the raster is compressed here, line by line, or
+ whole at GIF_COMPRESS_MAX.
+ Between EGifPutScreenDesc and EGifCloseFile this writes a GIF one frame at
+ a time, so a frame can be dropped as soon as it is written.
+******************************************************************************/
 int
-EGifSpew(GifFileType *GifFileOut) 
+EGifPutSavedImage(GifFileType *GifFile, const SavedImage *Image,
+                  const GifCompressedImage *Compressed)
 {
-    int i, j; 
+    int j;
+    int SavedHeight = Image->ImageDesc.Height;
+    int SavedWidth = Image->ImageDesc.Width;
+
+    if (EGifWriteExtensions(GifFile,
+			    Image->ExtensionBlocks,
+			    Image->ExtensionBlockCount) == GIF_ERROR)
+	return (GIF_ERROR);
+
+    if (EGifPutImageDesc(GifFile,
+                         Image->ImageDesc.Left,
+                         Image->ImageDesc.Top,
+                         SavedWidth,
+                         SavedHeight,
+                         Image->ImageDesc.Interlace,
+                         Image->ImageDesc.ColorMap) == GIF_ERROR)
+        return (GIF_ERROR);
+
+    if (Compressed != NULL) {
+	if (EGifPutCompressedImage(GifFile, Compressed) == GIF_ERROR)
+	    return (GIF_ERROR);
+    } else if (!Image->ImageDesc.Interlace
+               && ((GifFilePrivateType *)GifFile->Private)->CompressLevel
+                  == GIF_COMPRESS_MAX) {
+	if (EGifPutRaster(GifFile, Image->RasterBits,
+			  SavedWidth * SavedHeight) == GIF_ERROR)
+	    return (GIF_ERROR);
+    } else if (Image->ImageDesc.Interlace) {
+	 /* 
+	  * The way an interlaced image should be written - 
+	  * offsets and jumps...
+	  */
+	int InterlacedOffset[] = { 0, 4, 2, 1 };
+	int InterlacedJumps[] = { 8, 8, 4, 2 };
+	int k;
+	/* Need to perform 4 passes on the images: */
+	for (k = 0; k < 4; k++)
+	    for (j = InterlacedOffset[k]; 
+		 j < SavedHeight;
+		 j += InterlacedJumps[k]) {
+		if (EGifPutLine(GifFile, 
+				Image->RasterBits + j * SavedWidth, 
+				SavedWidth) == GIF_ERROR)
+		    return (GIF_ERROR);
+	    }
+    } else {
+	for (j = 0; j < SavedHeight; j++) {
+	    if (EGifPutLine(GifFile,
+			    Image->RasterBits + j * SavedWidth,
+			    SavedWidth) == GIF_ERROR)
+		return (GIF_ERROR);
+	}
+    }
+
+    return (GIF_OK);
+}
+
+static int
+EGifSpewImages(GifFileType *GifFileOut, const GifCompressedImage *Images)
+{
+    int i, Result = GIF_OK;
 
     if (EGifPutScreenDesc(GifFileOut,
                           GifFileOut->SWidth,
                           GifFileOut->SHeight,
                           GifFileOut->SColorResolution,
                           GifFileOut->SBackGroundColor,
-                          GifFileOut->SColorMap) == GIF_ERROR) {
-        return (GIF_ERROR);
-    }
+                          GifFileOut->SColorMap) == GIF_ERROR)
+        Result = GIF_ERROR;
 
-    for (i = 0; i < GifFileOut->ImageCount; i++) {
+    for (i = 0; i < GifFileOut->ImageCount && Result == GIF_OK; i++) {
         SavedImage *sp = &GifFileOut->SavedImages[i];
-        int SavedHeight = sp->ImageDesc.Height;
-        int SavedWidth = sp->ImageDesc.Width;
 
         /* this allows us to delete images by nuking their rasters */
         if (sp->RasterBits == NULL)
             continue;
 
-	if (EGifWriteExtensions(GifFileOut, 
-				sp->ExtensionBlocks,
-				sp->ExtensionBlockCount) == GIF_ERROR)
-	    return (GIF_ERROR);
-
-        if (EGifPutImageDesc(GifFileOut,
-                             sp->ImageDesc.Left,
-                             sp->ImageDesc.Top,
-                             SavedWidth,
-                             SavedHeight,
-                             sp->ImageDesc.Interlace,
-                             sp->ImageDesc.ColorMap) == GIF_ERROR)
-            return (GIF_ERROR);
-
-	if (sp->ImageDesc.Interlace) {
-	     /* 
-	      * The way an interlaced image should be written - 
-	      * offsets and jumps...
-	      */
-	    int InterlacedOffset[] = { 0, 4, 2, 1 };
-	    int InterlacedJumps[] = { 8, 8, 4, 2 };
-	    int k;
-	    /* Need to perform 4 passes on the images: */
-	    for (k = 0; k < 4; k++)
-		for (j = InterlacedOffset[k]; 
-		     j < SavedHeight;
-		     j += InterlacedJumps[k]) {
-		    if (EGifPutLine(GifFileOut, 
-				    sp->RasterBits + j * SavedWidth, 
-				    SavedWidth)	== GIF_ERROR)
-			return (GIF_ERROR);
-		}
-	} else {
-	    for (j = 0; j < SavedHeight; j++) {
-		if (EGifPutLine(GifFileOut,
-				sp->RasterBits + j * SavedWidth,
-				SavedWidth) == GIF_ERROR)
-		    return (GIF_ERROR);
-	    }
-	}
+	if (EGifPutSavedImage(GifFileOut, sp,
+			      Images != NULL ? &Images[i] : NULL) == GIF_ERROR)
+	    Result = GIF_ERROR;
     }
 
-    if (EGifWriteExtensions(GifFileOut,
-			    GifFileOut->ExtensionBlocks,
-			    GifFileOut->ExtensionBlockCount) == GIF_ERROR)
-	return (GIF_ERROR);
+    if (Result == GIF_OK
+        && EGifWriteExtensions(GifFileOut,
+			       GifFileOut->ExtensionBlocks,
+			       GifFileOut->ExtensionBlockCount) == GIF_ERROR)
+	Result = GIF_ERROR;
 
+    /* The file is closed, and GifFileOut freed, whether the writes went
+     * through or not: */
     if (EGifCloseFile(GifFileOut, NULL) == GIF_ERROR)
-        return (GIF_ERROR);
+        Result = GIF_ERROR;
 
-    return (GIF_OK);
+    return (Result);
+}
+
+int
+EGifSpew(GifFileType *GifFileOut) 
+{
+    return EGifSpewImages(GifFileOut, NULL);
+}
+
+/******************************************************************************
+ Like EGifSpew, but the data of every saved image comes compressed already,
+ Images[i] for SavedImages[i], so the images could be compressed in parallel.
+******************************************************************************/
+int
+EGifSpewCompressed(GifFileType *GifFileOut, const GifCompressedImage *Images)
+{
+    return EGifSpewImages(GifFileOut, Images);
 }
 
 /* end */
@@ -0,0 +1,336 @@
+/*****************************************************************************
+
+ egif_lzw.cpp - the LZ compression loop of the encoder
+
+ The loop of egif_lib.c that turns pixels into codes, with the dictionary
+ lookups, run strings and lossy matches under it, as templates on the code
+ size of the image.  The dictionary key of a string followed by a pixel is
+ the code of the string shifted by the code size, so the Clear code, the
+ masks and the shifts fold into constants, and the keys of an image of few
+ colors stay in the start of the table: 64K slots for 4 bits pixels rather
+ than the 1M slots 8 bits keys spread over, which stay in cache.
+ EGifCompressLine picks the loop of the code size from a table; the rest
+ of the encoder is left in C.
+
+******************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "gif_lib.h"
+#include "gif_lib_private.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define EGIF_RUN_SSE2
+#endif
+
+/* Shortest run of a pixel worth taking the run path of the encoder for: */
+#define EGIF_MIN_RUN	8
+
+/******************************************************************************
+ Constants of one code size, the bits of the pixels of the image.
+******************************************************************************/
+template <int Bits>
+struct LzwCodeSize {
+    enum {
+        CodeSize = Bits,
+        PixelMask = (1 << Bits) - 1,
+        ClearCode = 1 << Bits,
+        FirstCode = ClearCode + 2
+    };
+
+    /* The key of the string of code Code followed by Pixel: */
+    static uint32_t Key(int Code, int Pixel) {
+        return ((uint32_t)Code << Bits) + Pixel;
+    }
+};
+
+/******************************************************************************
+ The code of the string of Key in the dictionary, -1 if it is not there.
+******************************************************************************/
+static inline int
+ExistsKey(const GifHashTableType *HashTable, uint32_t Key) {
+    uint32_t Item = HashTable->HTable[Key];
+
+    if (HT_GET_GENERATION(Item) != HashTable->Generation)
+        return -1;
+    return HT_GET_CODE(Item);
+}
+
+/******************************************************************************
+ Put the new string of Key in the dictionary as Code, and follow it if it
+ makes the longest run string of its pixel one longer.
+******************************************************************************/
+template <int Bits>
+static inline void
+InsertKey(GifHashTableType *HashTable, uint32_t Key, int Code) {
+    int Pixel = Key & LzwCodeSize<Bits>::PixelMask,
+        Top = HashTable->RunTop[Pixel];
+
+    HashTable->HTable[Key] = HT_PUT_GENERATION(HashTable->Generation) |
+                             HT_PUT_CODE(Code);
+
+    if (Top < HT_RUN_CAP && HashTable->RunTopCode[Pixel] == Key >> Bits) {
+        HashTable->RunCodes[Pixel][++Top] = (uint16_t)Code;
+        HashTable->RunTop[Pixel] = (uint16_t)Top;
+        HashTable->RunTopCode[Pixel] = (uint16_t)Code;
+    }
+}
+
+/******************************************************************************
+ The length of Code as a run string of Pixel, 0 if it is none.  The codes
+ of those strings grow with their length, so they are bisected.
+******************************************************************************/
+static inline int
+RunStringLength(const GifHashTableType *HashTable, int Pixel, int Code) {
+    int Low = 1, High = HashTable->RunTop[Pixel], Mid;
+    const uint16_t *Codes = HashTable->RunCodes[Pixel];
+
+    while (Low <= High) {
+        Mid = (Low + High) >> 1;
+        if (Codes[Mid] == Code)
+            return Mid;
+        if (Codes[Mid] < Code)
+            Low = Mid + 1;
+        else
+            High = Mid - 1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ Number of pixels at the start of Line equal to its first one.
+******************************************************************************/
+static inline int
+RunLength(const GifPixelType *Line, int LineLen) {
+    int n = 1;
+#ifdef EGIF_RUN_SSE2
+    __m128i Pixel = _mm_set1_epi8((char)Line[0]);
+
+    /* Whole blocks of 16 first; the scalar loop finds the end in the last: */
+    while (n + 16 <= LineLen
+           && _mm_movemask_epi8(_mm_cmpeq_epi8(
+                  _mm_loadu_si128((const __m128i *)(Line + n)), Pixel))
+              == 0xFFFF)
+        n += 16;
+#endif /* EGIF_RUN_SSE2 */
+
+    while (n < LineLen && Line[n] == Line[0])
+        n++;
+    return n;
+}
+
+/******************************************************************************
+ Output Code, as EGifCompressOutput of egif_lib.c does short of a flush.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+static inline int
+OutputCode(GifFilePrivateType *Private, int Code) {
+    GifByteType *Out;
+
+    Private->CodeAcc |= ((uint64_t)Code) << Private->CodeAccBits;
+    Private->CodeAccBits += Private->RunningBits;
+    if (Private->CodeAccBits >= 32) {
+        /* Dump out four full bytes: */
+        if (Private->CodeBufLen + 4 > Private->CodeBufSize
+            && EGifReserveCodes(Private, 4) == GIF_ERROR)
+            return GIF_ERROR;
+        Out = Private->CodeBuf + Private->CodeBufLen;
+        Out[0] = (GifByteType)Private->CodeAcc;
+        Out[1] = (GifByteType)(Private->CodeAcc >> 8);
+        Out[2] = (GifByteType)(Private->CodeAcc >> 16);
+        Out[3] = (GifByteType)(Private->CodeAcc >> 24);
+        Private->CodeBufLen += 4;
+        Private->CodeAcc >>= 32;
+        Private->CodeAccBits -= 32;
+    }
+
+    /* If code cannt fit into RunningBits bits, must raise its size: */
+    if (Private->RunningCode >= Private->MaxCode1 && Code <= LZ_MAX_CODE)
+        Private->MaxCode1 = 1 << ++Private->RunningBits;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Give the string Key, just output as missing, the next code.  If however
+ the HashTable is full, we send a clear first and clear the hash table, or
+ keep it as it is past GIF_COMPRESS_FAST.
+******************************************************************************/
+template <int Bits>
+static int
+AddString(GifFilePrivateType *Private, uint32_t Key) {
+    if (Private->RunningCode >= LZ_MAX_CODE) {
+        if (Private->CompressLevel != GIF_COMPRESS_FAST)
+            return GIF_OK;
+        /* Time to do some clearance: */
+        if (OutputCode(Private, LzwCodeSize<Bits>::ClearCode) == GIF_ERROR)
+            return GIF_ERROR;
+        Private->RunningCode = LzwCodeSize<Bits>::FirstCode;
+        Private->RunningBits = Bits + 1;
+        Private->MaxCode1 = 1 << (Bits + 1);
+        _ClearHashTable(Private->HashTable);
+        Private->ClearCount++;
+    } else {
+        /* Put this unique key with its relative Code in hash table: */
+        InsertKey<Bits>(Private->HashTable, Key, Private->RunningCode++);
+    }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Look for a string of CrntCode followed by one of the near colors of Pixel,
+ nearest first.  Returns its code, or -1 if there is none.
+******************************************************************************/
+template <int Bits>
+static int
+LossyMatch(const GifFilePrivateType *Private, int CrntCode,
+           GifPixelType Pixel) {
+    uint32_t Prefix = LzwCodeSize<Bits>::Key(CrntCode, 0);
+    int j, Code;
+
+    for (j = 0; j < Private->LossyNearCount[Pixel]; j++)
+        if ((Code = ExistsKey(Private->HashTable,
+                              Prefix + Private->LossyNear[Pixel][j])) >= 0)
+            return Code;
+    return -1;
+}
+
+/******************************************************************************
+ Compress the next Run pixels, all equal to Pixel, given that *CrntCode is
+ the run string of Pixel of the given Length.  The table holds every run
+ string of Pixel up to RunTop[Pixel] long and no longer one, so the run
+ steps through the known ones in one go, and the one after is a miss for
+ sure; this gives exactly the codes of going pixel by pixel.  Runs longer
+ than HT_RUN_CAP are not followed, as longer run strings may then exist.
+   Returns the number of pixels compressed, -1 if failed.
+******************************************************************************/
+template <int Bits>
+static int
+CompressRun(GifFilePrivateType *Private, int *CrntCode, GifPixelType Pixel,
+            int Length, int Run) {
+    GifHashTableType *HashTable = Private->HashTable;
+    int Done = 0, Top, Step, Code;
+
+    while (Done < Run) {
+        Top = HashTable->RunTop[Pixel];
+        if (Length < Top) {
+            Step = Run - Done < Top - Length ? Run - Done : Top - Length;
+            Length += Step;
+            Done += Step;
+            continue;
+        }
+        if (Top == HT_RUN_CAP)
+            break;
+
+        /* One Pixel more than the longest run string, as in the loop of
+         * CompressLine:  */
+        Code = HashTable->RunCodes[Pixel][Length];
+        if (OutputCode(Private, Code) == GIF_ERROR
+            || AddString<Bits>(Private, LzwCodeSize<Bits>::Key(Code, Pixel))
+               == GIF_ERROR)
+            return -1;
+        Length = 1;
+        Done++;
+    }
+
+    *CrntCode = HashTable->RunCodes[Pixel][Length];
+    return Done;
+}
+
+/******************************************************************************
+ The LZ compression loop for pixels of Bits bits, see EGifCompressLine.
+   When the current string is a run of the next pixel, the rest of that run
+ goes through CompressRun instead, which gives the same codes without
+ looking up every pixel.  A lossy encoder tries the near colors of a pixel
+ only where the exact string is missing, so runs and hits cost the same.
+******************************************************************************/
+template <int Bits>
+static int
+CompressLine(GifFilePrivateType *Private, GifPixelType *Line, int LineLen) {
+    GifHashTableType *HashTable = Private->HashTable;
+    int i = 0, CrntCode, NewCode, Length, Done;
+    uint32_t NewKey;
+    GifPixelType Pixel;
+
+    if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
+        CrntCode = Line[i++];
+    else
+        CrntCode = Private->CrntCode;    /* Get last code in compression. */
+
+    while (i < LineLen) {   /* Decode LineLen items. */
+        Pixel = Line[i++];  /* Get next pixel from stream. */
+
+        /* A repeated pixel, or a longer run string of it, followed by a
+         * few more of the same pixel, so short runs stay on the plain path: */
+        if (i + EGIF_MIN_RUN <= LineLen && Line[i] == Pixel
+            && Line[i + EGIF_MIN_RUN - 2] == Pixel
+            && Line[i + EGIF_MIN_RUN - 1] == Pixel
+            && (Length = RunStringLength(HashTable, Pixel, CrntCode)) > 0) {
+            Done = CompressRun<Bits>(Private, &CrntCode, Pixel, Length,
+                                     RunLength(Line + i - 1,
+                                               LineLen - i + 1));
+            if (Done < 0)
+                return GIF_ERROR;
+            if (Done > 0) {
+                i += Done - 1;
+                continue;
+            }
+        }
+
+        NewKey = LzwCodeSize<Bits>::Key(CrntCode, Pixel);
+        if ((NewCode = ExistsKey(HashTable, NewKey)) >= 0) {
+            /* This Key is already there, or the string is old one, so
+             * simple take new code as our CrntCode:
+             */
+            CrntCode = NewCode;
+        } else if (Private->LossyError > 0
+                   && (NewCode = LossyMatch<Bits>(Private, CrntCode,
+                                                  Pixel)) >= 0) {
+            /* The string goes on with a color close enough instead: */
+            CrntCode = NewCode;
+            Private->LossyPixels++;
+        } else {
+            /* Output the prefix code, give the new string the next code,
+             * and make our CrntCode equal to Pixel:
+             */
+            if (OutputCode(Private, CrntCode) == GIF_ERROR
+                || AddString<Bits>(Private, NewKey) == GIF_ERROR)
+                return GIF_ERROR;
+            CrntCode = Pixel;
+        }
+    }
+
+    /* Preserve the current state of the compression algorithm: */
+    Private->CrntCode = CrntCode;
+
+    return GIF_OK;
+}
+
+typedef int (*CompressLineFunc)(GifFilePrivateType *Private,
+                                GifPixelType *Line, int LineLen);
+
+/* The loops by code size; pixels of 1 bit are compressed as 2 bits ones: */
+static const CompressLineFunc CompressLines[] = {
+    NULL, NULL,
+    CompressLine<2>, CompressLine<3>, CompressLine<4>,
+    CompressLine<5>, CompressLine<6>, CompressLine<7>, CompressLine<8>
+};
+
+/******************************************************************************
+ The LZ compression routine:
+ This version compresses the given buffer Line of length LineLen, of pixels
+ masked to Private->BitsPerPixel bits.
+ This routine can be called a few times (one per scan line, for example), in
+ order to complete the whole image.
+ Returns GIF_OK if succeeded.
+******************************************************************************/
+int
+EGifCompressLine(GifFilePrivateType *Private, GifPixelType *Line,
+                 const int LineLen) {
+    return CompressLines[Private->BitsPerPixel](Private, Line, LineLen);
+}
+
+/* end */
@@ -48,6 +48,9 @@ GifErrorString(int ErrorCode)
       case E_GIF_ERR_NOT_WRITEABLE:
         Err = "Given file was not opened for write";
         break;
+      case E_GIF_ERR_CODE_SIZE:
+        Err = "Compressed image does not fit the color map";
+        break;
       case D_GIF_ERR_OPEN_FAILED:
         Err = "Failed to open given file";
         break;
@@ -4,11 +4,13 @@
 
 ****************************************************************************/
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "gif_lib.h"
+#include "gif_lib_private.h"
 
 #define MAX(x, y)    (((x) > (y)) ? (x) : (y))
 
@@ -221,6 +223,29 @@ GifApplyTranslation(SavedImage *Image, GifPixelType Translation[])
 /******************************************************************************
  Extension record functions                              
 ******************************************************************************/
+
+/* 
+ * Fill in the block ep of an extension array with a copy of ExtData
+ */
+static int
+FillExtensionBlock(ExtensionBlock *ep,
+		   int Function,
+		   unsigned int Len,
+		   unsigned char ExtData[])
+{
+    ep->Function = Function;
+    ep->ByteCount=Len;
+    ep->Bytes = (GifByteType *)malloc(ep->ByteCount);
+    if (ep->Bytes == NULL)
+        return (GIF_ERROR);
+
+    if (ExtData != NULL) {
+        memcpy(ep->Bytes, ExtData, Len);
+    }
+
+    return (GIF_OK);
+}
+
 int
 GifAddExtensionBlock(int *ExtensionBlockCount,
 		     ExtensionBlock **ExtensionBlocks,
@@ -228,8 +253,6 @@ GifAddExtensionBlock(int *ExtensionBlockCount,
 		     unsigned int Len,
 		     unsigned char ExtData[])
 {
-    ExtensionBlock *ep;
-
     if (*ExtensionBlocks == NULL)
         *ExtensionBlocks=(ExtensionBlock *)malloc(sizeof(ExtensionBlock));
     else {
@@ -244,19 +267,43 @@ GifAddExtensionBlock(int *ExtensionBlockCount,
     if (*ExtensionBlocks == NULL)
         return (GIF_ERROR);
 
-    ep = &(*ExtensionBlocks)[(*ExtensionBlockCount)++];
+    return FillExtensionBlock(&(*ExtensionBlocks)[(*ExtensionBlockCount)++],
+                              Function, Len, ExtData);
+}
 
-    ep->Function = Function;
-    ep->ByteCount=Len;
-    ep->Bytes = (GifByteType *)malloc(ep->ByteCount);
-    if (ep->Bytes == NULL)
-        return (GIF_ERROR);
+/* 
+ * Like GifAddExtensionBlock, for an array the library allocated itself and
+ * has room for *ExtensionBlockCapacity blocks.  A full array doubles instead
+ * of growing by one block.  The capacity is the caller's to keep; an array
+ * handed on to code that does not track it grows one block at a time again.
+ */
+int
+GifAddGrowingExtensionBlock(int *ExtensionBlockCount,
+			    int *ExtensionBlockCapacity,
+			    ExtensionBlock **ExtensionBlocks,
+			    int Function,
+			    unsigned int Len,
+			    unsigned char ExtData[])
+{
+    int Capacity;
 
-    if (ExtData != NULL) {
-        memcpy(ep->Bytes, ExtData, Len);
+    if (*ExtensionBlocks == NULL
+        || *ExtensionBlockCount >= *ExtensionBlockCapacity) {
+        ExtensionBlock* ep_new;
+
+        Capacity = (*ExtensionBlockCount <= INT_MAX / 2)
+                   ? MAX(*ExtensionBlockCount * 2, 4)
+                   : *ExtensionBlockCount + 1;
+        ep_new = (ExtensionBlock *)reallocarray(*ExtensionBlocks, Capacity,
+                                                sizeof(ExtensionBlock));
+        if( ep_new == NULL )
+            return (GIF_ERROR);
+        *ExtensionBlocks = ep_new;
+        *ExtensionBlockCapacity = Capacity;
     }
 
-    return (GIF_OK);
+    return FillExtensionBlock(&(*ExtensionBlocks)[(*ExtensionBlockCount)++],
+                              Function, Len, ExtData);
 }
 
 void
@@ -317,19 +364,57 @@ FreeLastSavedImage(GifFileType *GifFile)
      */
 }
 
+/*
+ * Make room in the SavedImages array for at least ImageCapacity images, so
+ * that many can be appended without moving it.  A writer that knows its
+ * frame count calls this once before the first GifMakeSavedImage.
+ */
+int
+GifReserveSavedImages(GifFileType *GifFile, int ImageCapacity)
+{
+    SavedImage *NewImages;
+
+    if (GifFile->SavedImages != NULL
+        && ImageCapacity <= GifFile->SavedImageCapacity)
+        return (GIF_OK);
+
+    NewImages = (SavedImage *)reallocarray(GifFile->SavedImages,
+                                  MAX(ImageCapacity, GifFile->ImageCount),
+                                  sizeof(SavedImage));
+    if (NewImages == NULL)
+        return (GIF_ERROR);
+    GifFile->SavedImages = NewImages;
+    GifFile->SavedImageCapacity = MAX(ImageCapacity, GifFile->ImageCount);
+    return (GIF_OK);
+}
+
+/*
+ * Make room for one more image in the SavedImages array.  A full array
+ * doubles, so appending n images moves it about log2(n) times instead of n.
+ */
+int
+GifGrowSavedImages(GifFileType *GifFile)
+{
+    int Capacity;
+
+    if (GifFile->SavedImages != NULL
+        && GifFile->ImageCount < GifFile->SavedImageCapacity)
+        return (GIF_OK);
+
+    Capacity = MAX(GifFile->SavedImageCapacity, 4);
+    if (GifFile->SavedImages != NULL)
+        Capacity = (Capacity <= INT_MAX / 2) ? Capacity * 2
+                                             : GifFile->ImageCount + 1;
+    return GifReserveSavedImages(GifFile, MAX(Capacity, GifFile->ImageCount + 1));
+}
+
 /*
  * Append an image block to the SavedImages array  
  */
 SavedImage *
 GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
 {
-    if (GifFile->SavedImages == NULL)
-        GifFile->SavedImages = (SavedImage *)malloc(sizeof(SavedImage));
-    else
-        GifFile->SavedImages = (SavedImage *)reallocarray(GifFile->SavedImages,
-                               (GifFile->ImageCount + 1), sizeof(SavedImage));
-
-    if (GifFile->SavedImages == NULL)
+    if (GifGrowSavedImages(GifFile) == GIF_ERROR)
         return ((SavedImage *)NULL);
     else {
         SavedImage *sp = &GifFile->SavedImages[GifFile->ImageCount++];
@@ -408,6 +493,7 @@ GifFreeSavedImages(GifFileType *GifFile)
     }
     free((char *)GifFile->SavedImages);
     GifFile->SavedImages = NULL;
+    GifFile->SavedImageCapacity = 0;
 }
 
 /* end */
@@ -0,0 +1,1602 @@
+/*****************************************************************************
+
+ quantize.cpp - quantize a high resolution image into lower one
+
+ Based on: "Color Image Quantization for frame buffer Display", by
+ Paul Heckbert SIGGRAPH 1982 page 297-307.
+
+ This doesn't really belong in the core library, was undocumented,
+ and was removed in 4.2.  Then it turned out some client apps were
+ actually using it, so it was restored in 5.0.
+
+ The histogram and median cut are templates on the number of bits kept
+ per primary color, so the masks and shifts fold into constants.  The
+ 4 and 5 bit variants use a dense histogram (4096 and 32768 bins), the
+ 6 bit variant a hashed one, since 262144 dense bins would not stay in
+ cache for a frame that only uses a few thousand distinct colors.
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <new>
+#include "gif_lib.h"
+#include "gif_lib_private.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QUANTIZE_SSE2
+#endif
+
+#define ABS(x)    ((x) > 0 ? (x) : (-(x)))
+
+typedef struct QuantizedColorType {
+    GifByteType RGB[3];
+    GifByteType NewColorIndex;
+    long Count;
+    struct QuantizedColorType *Pnext;
+} QuantizedColorType;
+
+typedef struct NewColorMapType {
+    GifByteType RGBMin[3], RGBWidth[3];
+    unsigned int NumEntries; /* # of QuantizedColorType in linked list below */
+    unsigned long Count; /* Total number of pixels in all the entries */
+    QuantizedColorType *QuantizedColors;
+} NewColorMapType;
+
+/******************************************************************************
+ Scratch memory of the quantizer.  A caller that quantizes many frames keeps
+ one of these, so that once it is big enough no call allocates.  Every call
+ reserves what it needs up front and then carves its tables out of it.
+******************************************************************************/
+struct GifQuantizeScratch {
+    char *Base;
+    size_t Capacity, Used;
+};
+
+#define SCRATCH_ALIGN 16
+
+static size_t
+ScratchBytes(size_t Bytes) {
+    return (Bytes + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+}
+
+static bool
+ReserveScratch(GifQuantizeScratch *Scratch, size_t Capacity) {
+    Scratch->Used = 0;
+    if (Capacity <= Scratch->Capacity)
+        return true;
+
+    /* Nothing in it survives a call, so there is nothing to copy: */
+    free(Scratch->Base);
+    Scratch->Base = (char *)malloc(Capacity);
+    Scratch->Capacity = Scratch->Base != NULL ? Capacity : 0;
+    return Scratch->Base != NULL;
+}
+
+/* Never fails: the caller reserved enough for the whole call. */
+static void *
+ScratchAlloc(GifQuantizeScratch *Scratch, size_t Bytes) {
+    void *Block = Scratch->Base + Scratch->Used;
+
+    Scratch->Used += ScratchBytes(Bytes);
+    return Block;
+}
+
+/******************************************************************************
+ Constants of one histogram precision.
+******************************************************************************/
+template <int Bits>
+struct QuantizeBits {
+    enum {
+        BitsPerPrimColor = Bits,
+        MaxPrimColor = (1 << Bits) - 1,
+        ColorArraySize = 1 << (3 * Bits)
+    };
+
+    static unsigned int ColorIndex(GifByteType Red,
+                                   GifByteType Green,
+                                   GifByteType Blue) {
+        return ((Red >> (8 - Bits)) << (2 * Bits)) +
+               ((Green >> (8 - Bits)) << Bits) +
+               (Blue >> (8 - Bits));
+    }
+
+    static unsigned int IndexOfColor(const QuantizedColorType *Entry) {
+        return (Entry->RGB[0] << (2 * Bits)) + (Entry->RGB[1] << Bits) +
+               Entry->RGB[2];
+    }
+
+    static void ColorOfIndex(unsigned int Index, QuantizedColorType *Entry) {
+        Entry->RGB[0] = Index >> (2 * Bits);
+        Entry->RGB[1] = (Index >> Bits) & MaxPrimColor;
+        Entry->RGB[2] = Index & MaxPrimColor;
+    }
+};
+
+/******************************************************************************
+ Dense histogram: one entry per bin, addressed directly by the bin index.
+******************************************************************************/
+template <int Bits>
+class DenseHistogram {
+public:
+    typedef QuantizeBits<Bits> Traits;
+
+    DenseHistogram() : Entries(NULL) {}
+
+    static size_t ScratchSize(unsigned long NumPixels) {
+        (void)NumPixels;
+        return ScratchBytes(sizeof(QuantizedColorType) *
+                            Traits::ColorArraySize);
+    }
+
+    void Init(unsigned long NumPixels, GifQuantizeScratch *Scratch) {
+        unsigned int i;
+
+        (void)NumPixels;
+        Entries = (QuantizedColorType *)ScratchAlloc(Scratch,
+                     sizeof(QuantizedColorType) * Traits::ColorArraySize);
+
+        for (i = 0; i < Traits::ColorArraySize; i++) {
+            Traits::ColorOfIndex(i, &Entries[i]);
+            Entries[i].Count = 0;
+        }
+    }
+
+    void Add(unsigned int Index) {
+        Entries[Index].Count++;
+    }
+
+    QuantizedColorType *Find(unsigned int Index) {
+        return &Entries[Index];
+    }
+
+    /* Color map index of a bin, or -1 if no counted pixel fell into it.
+     * Count is dead once the color map is built, so a bin mapped after
+     * the fact is marked with a negative Count. */
+    int ColorMapIndex(unsigned int Index) const {
+        return Entries[Index].Count != 0 ? Entries[Index].NewColorIndex : -1;
+    }
+
+    void RememberColorMapIndex(unsigned int Index, int ColorIndex) {
+        Entries[Index].NewColorIndex = ColorIndex;
+        Entries[Index].Count = -1;
+    }
+
+    /* Find the non empty entries in the color table and chain them: */
+    QuantizedColorType *Chain(unsigned int *NumOfEntries) {
+        QuantizedColorType *First = NULL, *QuantizedColor = NULL;
+        unsigned int i;
+
+        *NumOfEntries = 0;
+        for (i = 0; i < Traits::ColorArraySize; i++)
+            if (Entries[i].Count > 0) {
+                if (QuantizedColor == NULL)
+                    First = &Entries[i];
+                else
+                    QuantizedColor->Pnext = &Entries[i];
+                QuantizedColor = &Entries[i];
+                (*NumOfEntries)++;
+            }
+        if (QuantizedColor != NULL)
+            QuantizedColor->Pnext = NULL;
+        return First;
+    }
+
+private:
+    QuantizedColorType *Entries;
+};
+
+/******************************************************************************
+ Hashed histogram: only the bins a frame actually uses get an entry.  The
+ slot table starts small and doubles, rehashing, whenever it would pass
+ half full, so it stays about the size of the colors the frame really has.
+ The entries sit in order of arrival in an array that never moves, with
+ room for every bin the frame could use; only the part filled is touched.
+ Probing is linear.
+******************************************************************************/
+template <int Bits>
+class SparseHistogram {
+public:
+    typedef QuantizeBits<Bits> Traits;
+
+    SparseHistogram() : Slots(NULL), Entries(NULL), Scratch(NULL),
+                        SlotMask(0), SlotShift(0), NumEntries(0),
+                        MaxEntries(0) {}
+
+    /* Room for the entries, and for every slot table on the way from the
+     * first to one that holds MaxEntries: */
+    static size_t ScratchSize(unsigned long NumPixels) {
+        unsigned long MaxEntries = std::min<unsigned long>(NumPixels,
+                                                    Traits::ColorArraySize);
+        unsigned int SlotBits, LastSlotBits = SlotBitsFor(MaxEntries);
+        size_t Size = ScratchBytes(sizeof(QuantizedColorType) * MaxEntries);
+
+        for (SlotBits = FIRST_SLOT_BITS; SlotBits <= LastSlotBits; SlotBits++)
+            Size += ScratchBytes(sizeof(SlotType) << SlotBits);
+        return Size;
+    }
+
+    void Init(unsigned long NumPixels, GifQuantizeScratch *Scratch) {
+        MaxEntries = std::min<unsigned long>(NumPixels,
+                                             Traits::ColorArraySize);
+        Entries = (QuantizedColorType *)ScratchAlloc(Scratch,
+                     sizeof(QuantizedColorType) * MaxEntries);
+        this->Scratch = Scratch;
+        NumEntries = 0;
+        NewSlots(FIRST_SLOT_BITS);
+    }
+
+    void Add(unsigned int Index) {
+        unsigned int Slot = SlotOf(Index);
+
+        while (Slots[Slot].Entry >= 0) {
+            if (Slots[Slot].Index == Index) {
+                Entries[Slots[Slot].Entry].Count++;
+                return;
+            }
+            Slot = (Slot + 1) & SlotMask;
+        }
+        if (Grow())
+            Slot = FreeSlotOf(Index);
+        Slots[Slot].Entry = NumEntries;
+        Slots[Slot].Index = Index;
+        Traits::ColorOfIndex(Index, &Entries[NumEntries]);
+        Entries[NumEntries++].Count = 1;
+    }
+
+    QuantizedColorType *Find(unsigned int Index) {
+        unsigned int Slot = SlotOf(Index);
+
+        while (Slots[Slot].Entry >= 0) {
+            if (Slots[Slot].Index == Index)
+                return &Entries[Slots[Slot].Entry];
+            Slot = (Slot + 1) & SlotMask;
+        }
+        return NULL;
+    }
+
+    int ColorMapIndex(unsigned int Index) {
+        QuantizedColorType *Entry = Find(Index);
+
+        return Entry != NULL ? Entry->NewColorIndex : -1;
+    }
+
+    /* Bins mapped after the fact are only cached while there is room. */
+    void RememberColorMapIndex(unsigned int Index, int ColorIndex) {
+        unsigned int Slot;
+
+        if (NumEntries == MaxEntries)
+            return;
+        Grow();
+        Slot = FreeSlotOf(Index);
+        Slots[Slot].Entry = NumEntries;
+        Slots[Slot].Index = Index;
+        Traits::ColorOfIndex(Index, &Entries[NumEntries]);
+        Entries[NumEntries].NewColorIndex = ColorIndex;
+        Entries[NumEntries++].Count = 0;
+    }
+
+    QuantizedColorType *Chain(unsigned int *NumOfEntries) {
+        unsigned int i;
+
+        *NumOfEntries = NumEntries;
+        if (NumEntries == 0)
+            return NULL;
+        for (i = 0; i + 1 < NumEntries; i++)
+            Entries[i].Pnext = &Entries[i + 1];
+        Entries[NumEntries - 1].Pnext = NULL;
+        return &Entries[0];
+    }
+
+private:
+    /* 1024 slots, 8 kB, hold the 512 colors of most simple frames: */
+    enum { FIRST_SLOT_BITS = 10 };
+
+    /* Keep the table at most half full: */
+    static unsigned int SlotBitsFor(unsigned long MaxEntries) {
+        unsigned int SlotBits = FIRST_SLOT_BITS;
+
+        while ((1UL << SlotBits) < 2 * MaxEntries)
+            SlotBits++;
+        return SlotBits;
+    }
+
+    /* Fibonacci hashing spreads neighbouring bins across the table. */
+    unsigned int SlotOf(unsigned int Index) const {
+        return (Index * 2654435761U) >> SlotShift;
+    }
+
+    unsigned int FreeSlotOf(unsigned int Index) const {
+        unsigned int Slot = SlotOf(Index);
+
+        while (Slots[Slot].Entry >= 0)
+            Slot = (Slot + 1) & SlotMask;
+        return Slot;
+    }
+
+    void NewSlots(unsigned int SlotBits) {
+        unsigned int i;
+
+        SlotMask = (1U << SlotBits) - 1;
+        SlotShift = 32 - SlotBits;
+        Slots = (SlotType *)ScratchAlloc(Scratch,
+                                         sizeof(SlotType) * (SlotMask + 1));
+        for (i = 0; i <= SlotMask; i++)
+            Slots[i].Entry = -1;
+    }
+
+    /* Double the slot table if one more entry would fill it past half,
+     * and tell so, the slots found in the old one being stale. */
+    bool Grow() {
+        SlotType *OldSlots = Slots;
+        unsigned int i, OldSlotCount = SlotMask + 1;
+
+        if (2 * (NumEntries + 1) <= OldSlotCount)
+            return false;
+        NewSlots(32 - SlotShift + 1);
+        for (i = 0; i < OldSlotCount; i++)
+            if (OldSlots[i].Entry >= 0)
+                Slots[FreeSlotOf(OldSlots[i].Index)] = OldSlots[i];
+        return true;
+    }
+
+    /* A slot keeps the bin it holds, so probing never touches the entries: */
+    typedef struct SlotType {
+        int Entry;
+        unsigned int Index;
+    } SlotType;
+
+    SlotType *Slots;
+    QuantizedColorType *Entries;
+    GifQuantizeScratch *Scratch;
+    unsigned int SlotMask, SlotShift, NumEntries, MaxEntries;
+};
+
+/****************************************************************************
+ Routine called by std::sort to compare two entries.
+*****************************************************************************/
+struct SortCmpRtn {
+    int SortRGBAxis;
+
+    bool operator()(const QuantizedColorType *entry1,
+                    const QuantizedColorType *entry2) const {
+        /* sort on all axes of the color space! */
+        int hash1 = entry1->RGB[SortRGBAxis] * 256 * 256
+                  + entry1->RGB[(SortRGBAxis+1) % 3] * 256
+                  + entry1->RGB[(SortRGBAxis+2) % 3];
+        int hash2 = entry2->RGB[SortRGBAxis] * 256 * 256
+                  + entry2->RGB[(SortRGBAxis+1) % 3] * 256
+                  + entry2->RGB[(SortRGBAxis+2) % 3];
+
+        return hash1 < hash2;
+    }
+};
+
+/******************************************************************************
+ Routine to subdivide the RGB space recursively using median cut in each
+ axes alternatingly until ColorMapSize different cubes exists.
+ The biggest cube in one dimension is subdivide unless it has only one entry.
+ SortArray must hold as many pointers as there are entries in all cubes.
+ Returns GIF_ERROR if failed, otherwise GIF_OK.
+*******************************************************************************/
+template <int Bits>
+static int
+SubdivColorMap(NewColorMapType * NewColorSubdiv,
+               unsigned int ColorMapSize,
+               unsigned int *NewColorMapSize,
+               QuantizedColorType **SortArray) {
+
+    int MaxSize;
+    unsigned int i, j, Index = 0, NumEntries, MinColor, MaxColor;
+    long Sum, Count;
+    QuantizedColorType *QuantizedColor;
+    SortCmpRtn SortCmp;
+
+    SortCmp.SortRGBAxis = 0;
+    while (ColorMapSize > *NewColorMapSize) {
+        /* Find candidate for subdivision: */
+        MaxSize = -1;
+        for (i = 0; i < *NewColorMapSize; i++) {
+            for (j = 0; j < 3; j++) {
+                if ((((int)NewColorSubdiv[i].RGBWidth[j]) > MaxSize) &&
+                      (NewColorSubdiv[i].NumEntries > 1)) {
+                    MaxSize = NewColorSubdiv[i].RGBWidth[j];
+                    Index = i;
+                    SortCmp.SortRGBAxis = j;
+                }
+            }
+        }
+
+        if (MaxSize == -1)
+            return GIF_OK;
+
+        /* Split the entry Index into two along the axis SortRGBAxis: */
+
+        /* Sort all elements in that entry along the given axis and split at
+         * the median.  SortArray has room for all the entries there are. */
+        for (j = 0, QuantizedColor = NewColorSubdiv[Index].QuantizedColors;
+             j < NewColorSubdiv[Index].NumEntries && QuantizedColor != NULL;
+             j++, QuantizedColor = QuantizedColor->Pnext)
+            SortArray[j] = QuantizedColor;
+
+	/*
+	 * std::sort isn't stable, so we sort on all three axes rather
+	 * than only the one specified by SortRGBAxis.  Every entry is a
+	 * distinct RGB tuple, so that makes the order total and the
+	 * result independent of the sort implementation and of the
+	 * order the histogram chained its entries in.
+	 */
+        std::sort(SortArray, SortArray + NewColorSubdiv[Index].NumEntries,
+                  SortCmp);
+
+        /* Relink the sorted list into one: */
+        for (j = 0; j < NewColorSubdiv[Index].NumEntries - 1; j++)
+            SortArray[j]->Pnext = SortArray[j + 1];
+        SortArray[NewColorSubdiv[Index].NumEntries - 1]->Pnext = NULL;
+        NewColorSubdiv[Index].QuantizedColors = QuantizedColor = SortArray[0];
+
+        /* Now simply add the Counts until we have half of the Count: */
+        Sum = NewColorSubdiv[Index].Count / 2 - QuantizedColor->Count;
+        NumEntries = 1;
+        Count = QuantizedColor->Count;
+        while (QuantizedColor->Pnext != NULL &&
+	       (Sum -= QuantizedColor->Pnext->Count) >= 0 &&
+               QuantizedColor->Pnext->Pnext != NULL) {
+            QuantizedColor = QuantizedColor->Pnext;
+            NumEntries++;
+            Count += QuantizedColor->Count;
+        }
+        /* Save the values of the last color of the first half, and first
+         * of the second half so we can update the Bounding Boxes later.
+         * Also as the colors are quantized and the BBoxes are full 0..255,
+         * they need to be rescaled.
+         */
+        MaxColor = QuantizedColor->RGB[SortCmp.SortRGBAxis]; /* Max. of first half */
+	/* coverity[var_deref_op] */
+        MinColor = QuantizedColor->Pnext->RGB[SortCmp.SortRGBAxis]; /* of second */
+        MaxColor <<= (8 - Bits);
+        MinColor <<= (8 - Bits);
+
+        /* Partition right here: */
+        NewColorSubdiv[*NewColorMapSize].QuantizedColors =
+           QuantizedColor->Pnext;
+        QuantizedColor->Pnext = NULL;
+        NewColorSubdiv[*NewColorMapSize].Count = Count;
+        NewColorSubdiv[Index].Count -= Count;
+        NewColorSubdiv[*NewColorMapSize].NumEntries =
+           NewColorSubdiv[Index].NumEntries - NumEntries;
+        NewColorSubdiv[Index].NumEntries = NumEntries;
+        for (j = 0; j < 3; j++) {
+            NewColorSubdiv[*NewColorMapSize].RGBMin[j] =
+               NewColorSubdiv[Index].RGBMin[j];
+            NewColorSubdiv[*NewColorMapSize].RGBWidth[j] =
+               NewColorSubdiv[Index].RGBWidth[j];
+        }
+        NewColorSubdiv[*NewColorMapSize].RGBWidth[SortCmp.SortRGBAxis] =
+           NewColorSubdiv[*NewColorMapSize].RGBMin[SortCmp.SortRGBAxis] +
+           NewColorSubdiv[*NewColorMapSize].RGBWidth[SortCmp.SortRGBAxis] -
+           MinColor;
+        NewColorSubdiv[*NewColorMapSize].RGBMin[SortCmp.SortRGBAxis] =
+           MinColor;
+
+        NewColorSubdiv[Index].RGBWidth[SortCmp.SortRGBAxis] =
+           MaxColor - NewColorSubdiv[Index].RGBMin[SortCmp.SortRGBAxis];
+
+        (*NewColorMapSize)++;
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Color map index of the bin Index.  Bins no counted pixel fell into (which
+ dithering can move a pixel into) get the nearest color map entry, looked
+ up once per bin and remembered in the histogram.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+MapBin(HistogramType &Histogram,
+       unsigned int Index,
+       const GifColorType * ColorMap,
+       unsigned int ColorMapSize) {
+
+    QuantizedColorType Bin;
+    int ColorIndex = Histogram.ColorMapIndex(Index), Red, Green, Blue;
+    long Dist, MinDist = -1;
+    unsigned int i;
+
+    if (ColorIndex >= 0)
+        return ColorIndex;
+
+    /* Compare against the center of the bin: */
+    QuantizeBits<Bits>::ColorOfIndex(Index, &Bin);
+    Red = (Bin.RGB[0] << (8 - Bits)) + (1 << (7 - Bits));
+    Green = (Bin.RGB[1] << (8 - Bits)) + (1 << (7 - Bits));
+    Blue = (Bin.RGB[2] << (8 - Bits)) + (1 << (7 - Bits));
+    for (i = 0; i < ColorMapSize; i++) {
+        Dist = (long)(ColorMap[i].Red - Red) * (ColorMap[i].Red - Red) +
+               (long)(ColorMap[i].Green - Green) * (ColorMap[i].Green - Green) +
+               (long)(ColorMap[i].Blue - Blue) * (ColorMap[i].Blue - Blue);
+        if (MinDist < 0 || Dist < MinDist) {
+            MinDist = Dist;
+            ColorIndex = i;
+        }
+    }
+
+    Histogram.RememberColorMapIndex(Index, ColorIndex);
+    return ColorIndex;
+}
+
+static int
+ClampPrimColor(int Color) {
+    return Color < 0 ? 0 : (Color > 255 ? 255 : Color);
+}
+
+/* 8x8 Bayer threshold matrix, values 0..63. */
+static const GifByteType BayerMatrix[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+#ifdef QUANTIZE_SSE2
+/******************************************************************************
+ Eight pixels of one channel plus their threshold offsets, clamped to 0..255
+ and cut to Bits bits, in 16 bits lanes.
+******************************************************************************/
+template <int Bits>
+static inline __m128i
+ThresholdChannel(const GifByteType *Input, __m128i Offsets) {
+    const __m128i Zero = _mm_setzero_si128();
+    __m128i Channel = _mm_unpacklo_epi8(
+                          _mm_loadl_epi64((const __m128i *)Input), Zero);
+
+    Channel = _mm_add_epi16(Channel, Offsets);
+    Channel = _mm_min_epi16(_mm_max_epi16(Channel, Zero),
+                            _mm_set1_epi16(255));
+    return _mm_srli_epi16(Channel, 8 - Bits);
+}
+#endif /* QUANTIZE_SSE2 */
+
+/******************************************************************************
+ Threshold one row of Width pixels into the bin indexes of RowIndex, with
+ Offset[x & 7] added to every channel of pixel x.  With SSE2 eight pixels
+ are done at once, as the offsets of a row repeat every eight pixels; the
+ scalar loop does the tail and gives the same indexes.
+******************************************************************************/
+template <int Bits>
+static void
+ThresholdRow(unsigned int Width,
+             const GifByteType * Red,
+             const GifByteType * Green,
+             const GifByteType * Blue,
+             const int *Offset,
+             unsigned int *RowIndex) {
+
+    typedef QuantizeBits<Bits> Traits;
+
+    unsigned int x = 0;
+#ifdef QUANTIZE_SSE2
+    const __m128i Zero = _mm_setzero_si128();
+    const __m128i Offsets = _mm_setr_epi16(Offset[0], Offset[1], Offset[2],
+                                           Offset[3], Offset[4], Offset[5],
+                                           Offset[6], Offset[7]);
+
+    for (; x + 8 <= Width; x += 8) {
+        __m128i R = ThresholdChannel<Bits>(Red + x, Offsets);
+        __m128i G = ThresholdChannel<Bits>(Green + x, Offsets);
+        __m128i B = ThresholdChannel<Bits>(Blue + x, Offsets);
+
+        /* The index takes up to 18 bits, so it is put together in 32: */
+        __m128i Low = _mm_add_epi32(
+            _mm_slli_epi32(_mm_unpacklo_epi16(R, Zero), 2 * Bits),
+            _mm_slli_epi32(_mm_unpacklo_epi16(G, Zero), Bits));
+        __m128i High = _mm_add_epi32(
+            _mm_slli_epi32(_mm_unpackhi_epi16(R, Zero), 2 * Bits),
+            _mm_slli_epi32(_mm_unpackhi_epi16(G, Zero), Bits));
+
+        _mm_storeu_si128((__m128i *)(RowIndex + x),
+                         _mm_add_epi32(Low, _mm_unpacklo_epi16(B, Zero)));
+        _mm_storeu_si128((__m128i *)(RowIndex + x + 4),
+                         _mm_add_epi32(High, _mm_unpackhi_epi16(B, Zero)));
+    }
+#endif /* QUANTIZE_SSE2 */
+
+    for (; x < Width; x++)
+        RowIndex[x] = Traits::ColorIndex(
+                         ClampPrimColor(Red[x] + Offset[x & 7]),
+                         ClampPrimColor(Green[x] + Offset[x & 7]),
+                         ClampPrimColor(Blue[x] + Offset[x & 7]));
+}
+
+/******************************************************************************
+ Map the input through the color map with ordered (Bayer) dithering.  The
+ threshold offset spans roughly the distance between two neighbouring
+ colors of a ColorMapSize color map.  Each row is thresholded into bin
+ indexes first, by ThresholdRow, and only then looked up.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+MapOrdered(unsigned int Width,
+           unsigned int Height,
+           const GifByteType * RedInput,
+           const GifByteType * GreenInput,
+           const GifByteType * BlueInput,
+           GifByteType * OutputBuffer,
+           const GifColorType * OutputColorMap,
+           unsigned int ColorMapSize,
+           const GifByteType * TransparentMask,
+           HistogramType &Histogram,
+           GifQuantizeScratch *Scratch) {
+
+    unsigned int x, y, *RowIndex, Levels = 2;
+    int Spread, Offset[8];
+
+    RowIndex = (unsigned int *)ScratchAlloc(Scratch,
+                                            sizeof(unsigned int) * Width);
+
+    while (Levels * Levels * Levels < ColorMapSize)
+        Levels++;
+    Spread = 256 / Levels;
+
+    for (y = 0; y < Height; y++) {
+        const GifByteType *Red = RedInput + y * Width;
+        const GifByteType *Green = GreenInput + y * Width;
+        const GifByteType *Blue = BlueInput + y * Width;
+
+        for (x = 0; x < 8; x++)
+            Offset[x] = (((BayerMatrix[y & 7][x] * 2 + 1) * Spread) >> 7) -
+                        (Spread >> 1);
+
+        ThresholdRow<Bits>(Width, Red, Green, Blue, Offset, RowIndex);
+
+        for (x = 0; x < Width; x++)
+            OutputBuffer[y * Width + x] =
+                TransparentMask != NULL && TransparentMask[y * Width + x] ?
+                    ColorMapSize :
+                    MapBin<Bits>(Histogram, RowIndex[x], OutputColorMap,
+                                 ColorMapSize);
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Map the input through the color map with Floyd-Steinberg error diffusion,
+ scanning rows in alternating directions (serpentine) to avoid the
+ directional artifacts of plain raster order.  Errors are kept in 1/16ths
+ for the current and the next row, padded by one pixel on each side.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+MapFloydSteinberg(unsigned int Width,
+                  unsigned int Height,
+                  const GifByteType * RedInput,
+                  const GifByteType * GreenInput,
+                  const GifByteType * BlueInput,
+                  GifByteType * OutputBuffer,
+                  const GifColorType * OutputColorMap,
+                  unsigned int ColorMapSize,
+                  const GifByteType * TransparentMask,
+                  HistogramType &Histogram,
+                  GifQuantizeScratch *Scratch) {
+
+    typedef QuantizeBits<Bits> Traits;
+
+    unsigned int n, x, y, i;
+    int *ErrorRows, *CrntError, *NextError, *Swap, Step, Color[3], Error[3],
+        ColorIndex, j;
+
+    ErrorRows = (int *)ScratchAlloc(Scratch, sizeof(int) * 2 * 3 * (Width + 2));
+    memset(ErrorRows, 0, sizeof(int) * 3 * (Width + 2));
+    CrntError = ErrorRows;
+    NextError = ErrorRows + 3 * (Width + 2);
+
+    for (y = 0; y < Height; y++) {
+        Step = (y & 1) ? -1 : 1;
+        memset(NextError, 0, sizeof(int) * 3 * (Width + 2));
+
+        for (n = 0; n < Width; n++) {
+            x = (y & 1) ? Width - 1 - n : n;
+            i = y * Width + x;
+
+            /* A transparent pixel shows an earlier image, its error is not
+             * known here and the error coming to it is dropped: */
+            if (TransparentMask != NULL && TransparentMask[i]) {
+                OutputBuffer[i] = ColorMapSize;
+                continue;
+            }
+
+            Color[0] = ClampPrimColor(RedInput[i] + CrntError[3 * (x + 1)] / 16);
+            Color[1] = ClampPrimColor(GreenInput[i] +
+                                      CrntError[3 * (x + 1) + 1] / 16);
+            Color[2] = ClampPrimColor(BlueInput[i] +
+                                      CrntError[3 * (x + 1) + 2] / 16);
+
+            ColorIndex = MapBin<Bits>(Histogram,
+                            Traits::ColorIndex(Color[0], Color[1], Color[2]),
+                            OutputColorMap, ColorMapSize);
+            OutputBuffer[i] = ColorIndex;
+
+            Error[0] = Color[0] - OutputColorMap[ColorIndex].Red;
+            Error[1] = Color[1] - OutputColorMap[ColorIndex].Green;
+            Error[2] = Color[2] - OutputColorMap[ColorIndex].Blue;
+
+            /* 7/16 ahead, 3/16 behind below, 5/16 below, 1/16 ahead below: */
+            for (j = 0; j < 3; j++) {
+                CrntError[3 * (x + 1 + Step) + j] += Error[j] * 7;
+                NextError[3 * (x + 1 - Step) + j] += Error[j] * 3;
+                NextError[3 * (x + 1) + j] += Error[j] * 5;
+                NextError[3 * (x + 1 + Step) + j] += Error[j];
+            }
+        }
+
+        Swap = CrntError;
+        CrntError = NextError;
+        NextError = Swap;
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Count the pixels of an image into Histogram.  With SampleStride above one
+ only one pixel out of every SampleStride is counted: the first of each run
+ if *SampleSeed is zero, otherwise one picked pseudo randomly, which avoids
+ aliasing with regular patterns such as dithering.  The generator state is
+ kept in *SampleSeed so consecutive images do not sample the same pixels.
+   Pixels set in TransparentMask, if not NULL, are never counted.
+   Returns the number of pixels counted.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static unsigned long
+SampleHistogram(HistogramType &Histogram,
+                unsigned long NumPixels,
+                const GifByteType * RedInput,
+                const GifByteType * GreenInput,
+                const GifByteType * BlueInput,
+                const GifByteType * TransparentMask,
+                unsigned int SampleStride,
+                unsigned int *SampleSeed) {
+
+    typedef QuantizeBits<Bits> Traits;
+
+    unsigned long i, Run, NumSamples = 0;
+
+    if (SampleStride <= 1 && TransparentMask == NULL) {
+        for (i = 0; i < NumPixels; i++)
+            Histogram.Add(Traits::ColorIndex(RedInput[i], GreenInput[i],
+                                             BlueInput[i]));
+        return NumPixels;
+    }
+    if (SampleStride <= 1) {
+        for (i = 0; i < NumPixels; i++)
+            if (!TransparentMask[i]) {
+                Histogram.Add(Traits::ColorIndex(RedInput[i], GreenInput[i],
+                                                 BlueInput[i]));
+                NumSamples++;
+            }
+        return NumSamples;
+    }
+
+    for (Run = 0; Run < NumPixels; Run += SampleStride) {
+        i = Run;
+        if (*SampleSeed != 0) {
+            *SampleSeed = *SampleSeed * 1103515245U + 12345U;
+            i += (*SampleSeed >> 8) % SampleStride;
+            if (i >= NumPixels)
+                break;
+        }
+        if (TransparentMask != NULL && TransparentMask[i])
+            continue;
+        Histogram.Add(Traits::ColorIndex(RedInput[i], GreenInput[i],
+                                         BlueInput[i]));
+        NumSamples++;
+    }
+    return NumSamples;
+}
+
+/******************************************************************************
+ Build a color map of at most *ColorMapSize colors from a histogram of
+ NumSamples pixels, by median cut.  Every counted bin is left holding its
+ color map index.  *ColorMapSize is updated to the real size.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+BuildColorMap(HistogramType &Histogram,
+              unsigned long NumSamples,
+              QuantizedColorType **SortArray,
+              int *ColorMapSize,
+              GifColorType * OutputColorMap) {
+
+    unsigned int NumOfEntries;
+    int i, j;
+    unsigned int NewColorMapSize;
+    long Red, Green, Blue;
+    NewColorMapType NewColorSubdiv[256];
+    QuantizedColorType *QuantizedColor;
+
+    /* Put all the colors in the first entry of the color map, and call the
+     * recursive subdivision process.  */
+    for (i = 0; i < 256; i++) {
+        NewColorSubdiv[i].QuantizedColors = NULL;
+        NewColorSubdiv[i].Count = NewColorSubdiv[i].NumEntries = 0;
+        for (j = 0; j < 3; j++) {
+            NewColorSubdiv[i].RGBMin[j] = 0;
+            NewColorSubdiv[i].RGBWidth[j] = 255;
+        }
+    }
+
+    NewColorSubdiv[0].QuantizedColors = Histogram.Chain(&NumOfEntries);
+    if (NewColorSubdiv[0].QuantizedColors == NULL)
+        return GIF_ERROR;
+
+    NewColorSubdiv[0].NumEntries = NumOfEntries; /* Different sampled colors */
+    NewColorSubdiv[0].Count = NumSamples; /* Pixels */
+    NewColorMapSize = 1;
+    if (SubdivColorMap<Bits>(NewColorSubdiv, *ColorMapSize,
+                             &NewColorMapSize, SortArray) != GIF_OK)
+        return GIF_ERROR;
+    if (NewColorMapSize < (unsigned int)*ColorMapSize) {
+        /* And clear rest of color map: */
+        for (i = NewColorMapSize; i < *ColorMapSize; i++)
+            OutputColorMap[i].Red = OutputColorMap[i].Green =
+                OutputColorMap[i].Blue = 0;
+    }
+
+    /* Average the colors in each entry to be the color to be used in the
+     * output color map, and plug it into the output color map itself. */
+    for (i = 0; i < (int)NewColorMapSize; i++) {
+        if ((j = NewColorSubdiv[i].NumEntries) > 0) {
+            QuantizedColor = NewColorSubdiv[i].QuantizedColors;
+            Red = Green = Blue = 0;
+            while (QuantizedColor) {
+                QuantizedColor->NewColorIndex = i;
+                Red += QuantizedColor->RGB[0];
+                Green += QuantizedColor->RGB[1];
+                Blue += QuantizedColor->RGB[2];
+                QuantizedColor = QuantizedColor->Pnext;
+            }
+            OutputColorMap[i].Red = (Red << (8 - Bits)) / j;
+            OutputColorMap[i].Green = (Green << (8 - Bits)) / j;
+            OutputColorMap[i].Blue = (Blue << (8 - Bits)) / j;
+        }
+    }
+
+    *ColorMapSize = NewColorMapSize;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Bytes of scratch MapImage carves out of its arena.
+******************************************************************************/
+static size_t
+MapScratchSize(unsigned int Width, int DitherMode) {
+
+    if (DitherMode == GIF_DITHER_ORDERED)
+        return ScratchBytes(sizeof(unsigned int) * Width);
+    else if (DitherMode == GIF_DITHER_FLOYD_STEINBERG)
+        return ScratchBytes(sizeof(int) * 2 * 3 * (Width + 2));
+    return 0;
+}
+
+/******************************************************************************
+ Scan the input buffer again and put the mapped index in the output buffer.
+ Bins the histogram never counted, because it was sampled or built from
+ other images, get the nearest color.  Pixels set in TransparentMask, if
+ not NULL, get index ColorMapSize, the entry after the colors.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+MapImage(HistogramType &Histogram,
+         unsigned int Width,
+         unsigned int Height,
+         const GifByteType * RedInput,
+         const GifByteType * GreenInput,
+         const GifByteType * BlueInput,
+         GifByteType * OutputBuffer,
+         const GifColorType * OutputColorMap,
+         unsigned int ColorMapSize,
+         const GifByteType * TransparentMask,
+         int DitherMode,
+         GifQuantizeScratch *Scratch) {
+
+    typedef QuantizeBits<Bits> Traits;
+
+    unsigned long i, NumPixels = ((unsigned long)Width) * Height;
+
+    if (DitherMode == GIF_DITHER_ORDERED)
+        return MapOrdered<Bits>(Width, Height, RedInput, GreenInput,
+                                BlueInput, OutputBuffer, OutputColorMap,
+                                ColorMapSize, TransparentMask, Histogram,
+                                Scratch);
+    else if (DitherMode == GIF_DITHER_FLOYD_STEINBERG)
+        return MapFloydSteinberg<Bits>(Width, Height, RedInput, GreenInput,
+                                       BlueInput, OutputBuffer,
+                                       OutputColorMap, ColorMapSize,
+                                       TransparentMask, Histogram, Scratch);
+
+    if (TransparentMask != NULL) {
+        for (i = 0; i < NumPixels; i++)
+            OutputBuffer[i] = TransparentMask[i] ? ColorMapSize :
+                MapBin<Bits>(Histogram,
+                             Traits::ColorIndex(RedInput[i], GreenInput[i],
+                                                BlueInput[i]),
+                             OutputColorMap, ColorMapSize);
+        return GIF_OK;
+    }
+
+    for (i = 0; i < NumPixels; i++)
+        OutputBuffer[i] = MapBin<Bits>(Histogram,
+                             Traits::ColorIndex(RedInput[i], GreenInput[i],
+                                                BlueInput[i]),
+                             OutputColorMap, ColorMapSize);
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Bytes of scratch one QuantizeBuffer call carves out of its arena.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static size_t
+QuantizeScratchSize(unsigned int Width,
+                    unsigned long NumPixels,
+                    int DitherMode) {
+
+    return HistogramType::ScratchSize(NumPixels) +
+        ScratchBytes(sizeof(QuantizedColorType *) *
+            std::min<unsigned long>(NumPixels,
+                                    QuantizeBits<Bits>::ColorArraySize)) +
+        MapScratchSize(Width, DitherMode);
+}
+
+/******************************************************************************
+ GifQuantizeBuffer specialized on the histogram precision and layout.
+ See GifQuantizeBuffer for the meaning of the parameters.
+******************************************************************************/
+template <int Bits, class HistogramType>
+static int
+QuantizeBuffer(unsigned int Width,
+               unsigned int Height,
+               int *ColorMapSize,
+               GifByteType * RedInput,
+               GifByteType * GreenInput,
+               GifByteType * BlueInput,
+               GifByteType * OutputBuffer,
+               GifColorType * OutputColorMap,
+               int DitherMode,
+               unsigned int SampleStride,
+               unsigned int SampleSeed,
+               const GifByteType * TransparentMask,
+               GifQuantizeScratch *Scratch) {
+
+    unsigned long NumPixels = ((unsigned long)Width) * Height, NumSamples;
+    QuantizedColorType **SortArray;
+    HistogramType Histogram;
+
+    if (!ReserveScratch(Scratch,
+            QuantizeScratchSize<Bits, HistogramType>(Width, NumPixels,
+                                                     DitherMode)))
+        return GIF_ERROR;
+
+    Histogram.Init(NumPixels, Scratch);
+    SortArray = (QuantizedColorType **)ScratchAlloc(Scratch,
+                   sizeof(QuantizedColorType *) *
+                   std::min<unsigned long>(NumPixels,
+                                           QuantizeBits<Bits>::ColorArraySize));
+
+    /* Sample the colors and their distribution: */
+    NumSamples = SampleHistogram<Bits>(Histogram, NumPixels, RedInput,
+                                       GreenInput, BlueInput,
+                                       TransparentMask, SampleStride,
+                                       &SampleSeed);
+
+    /* The transparent entry is kept out of the median cut, so none of the
+     * colors goes to pixels that will not show: */
+    if (TransparentMask != NULL) {
+        if (*ColorMapSize < 2)
+            return GIF_ERROR;
+        (*ColorMapSize)--;
+        memset(&OutputColorMap[*ColorMapSize], 0, sizeof(GifColorType));
+    }
+    if (NumSamples == 0 && TransparentMask != NULL) {
+        /* Every pixel is transparent, the color map is all unused: */
+        memset(OutputColorMap, 0, sizeof(GifColorType) * *ColorMapSize);
+        *ColorMapSize = 0;
+    } else if (BuildColorMap<Bits>(Histogram, NumSamples, SortArray,
+                                 ColorMapSize, OutputColorMap) != GIF_OK)
+        return GIF_ERROR;
+
+    if (MapImage<Bits>(Histogram, Width, Height, RedInput, GreenInput,
+                       BlueInput, OutputBuffer, OutputColorMap,
+                       *ColorMapSize, TransparentMask, DitherMode,
+                       Scratch) != GIF_OK)
+        return GIF_ERROR;
+
+    /* The transparent entry, black as the rest of the unused tail: */
+    if (TransparentMask != NULL)
+        (*ColorMapSize)++;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize high resolution image into lower one. Input image consists of a
+ 2D array for each of the RGB colors with size Width by Height. There is no
+ Color map for the input. Output is a quantized image with 2D array of
+ indexes into the output color map.
+   Note input image can be 24 bits at the most (8 for red/green/blue) and
+ the output has 256 colors at the most (256 entries in the color map.).
+ ColorMapSize specifies size of color map up to 256 and will be updated to
+ real size before returning.
+   Also non of the parameter are allocated by this routine.
+   Options selects the histogram precision, dithering and sampling; NULL
+ gives the classic 5 bits per primary color without dithering, counting
+ every pixel.  A sampled histogram is cheaper and good enough for previews
+ and size estimates; pixels of colors it missed get the nearest color.
+   With a TransparentMask in Options, the pixels set in it are left out of
+ the color map, which then has at most ColorMapSize - 1 colors, and get
+ the index of the entry right after the last color, the last one counted
+ in the updated ColorMapSize.  It is meant for the transparent color of
+ the image, and is black in the color map.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int
+GifQuantizeBufferEx(unsigned int Width,
+               unsigned int Height,
+               int *ColorMapSize,
+               GifByteType * RedInput,
+               GifByteType * GreenInput,
+               GifByteType * BlueInput,
+               GifByteType * OutputBuffer,
+               GifColorType * OutputColorMap,
+               const GifQuantizeOptions * Options) {
+
+    int BitsPerPrimColor = Options != NULL ? Options->BitsPerPrimColor
+                                           : GIF_QUANTIZE_DEFAULT_BITS;
+    int DitherMode = Options != NULL ? Options->DitherMode : GIF_DITHER_NONE;
+    unsigned int SampleStride = Options != NULL ? Options->SampleStride : 1;
+    unsigned int SampleSeed = Options != NULL ? Options->SampleSeed : 0;
+    const GifByteType *TransparentMask = Options != NULL ?
+                                         Options->TransparentMask : NULL;
+    GifQuantizeScratch LocalScratch = { NULL, 0, 0 };
+    GifQuantizeScratch *Scratch = Options != NULL && Options->Scratch != NULL
+                                  ? Options->Scratch : &LocalScratch;
+    int Status;
+
+    switch (BitsPerPrimColor) {
+      case 4:
+        Status = QuantizeBuffer<4, DenseHistogram<4> >(Width, Height,
+                   ColorMapSize, RedInput, GreenInput, BlueInput,
+                   OutputBuffer, OutputColorMap, DitherMode, SampleStride,
+                   SampleSeed, TransparentMask, Scratch);
+        break;
+      case 5:
+        Status = QuantizeBuffer<5, DenseHistogram<5> >(Width, Height,
+                   ColorMapSize, RedInput, GreenInput, BlueInput,
+                   OutputBuffer, OutputColorMap, DitherMode, SampleStride,
+                   SampleSeed, TransparentMask, Scratch);
+        break;
+      case 6:
+        Status = QuantizeBuffer<6, SparseHistogram<6> >(Width, Height,
+                   ColorMapSize, RedInput, GreenInput, BlueInput,
+                   OutputBuffer, OutputColorMap, DitherMode, SampleStride,
+                   SampleSeed, TransparentMask, Scratch);
+        break;
+      default:
+        Status = GIF_ERROR;
+        break;
+    }
+
+    free(LocalScratch.Base);
+    return Status;
+}
+
+/******************************************************************************
+ Allocate a scratch arena for GifQuantizeBufferEx, big enough for frames of
+ Width by Height pixels at any precision and dither mode, so that passing it
+ in GifQuantizeOptions.Scratch makes quantizing such frames malloc free.
+ Bigger frames still work; the arena then grows once to fit.  Returns NULL
+ if out of memory.
+******************************************************************************/
+GifQuantizeScratch *
+GifNewQuantizeScratch(unsigned int Width, unsigned int Height) {
+
+    unsigned long NumPixels = ((unsigned long)Width) * Height;
+    size_t Capacity = std::max(std::max(
+        QuantizeScratchSize<4, DenseHistogram<4> >(Width, NumPixels,
+                                        GIF_DITHER_FLOYD_STEINBERG),
+        QuantizeScratchSize<5, DenseHistogram<5> >(Width, NumPixels,
+                                        GIF_DITHER_FLOYD_STEINBERG)),
+        QuantizeScratchSize<6, SparseHistogram<6> >(Width, NumPixels,
+                                        GIF_DITHER_FLOYD_STEINBERG));
+    GifQuantizeScratch *Scratch;
+
+    Scratch = (GifQuantizeScratch *)malloc(sizeof(GifQuantizeScratch));
+    if (Scratch == NULL)
+        return NULL;
+    Scratch->Base = NULL;
+    Scratch->Capacity = Scratch->Used = 0;
+    if (!ReserveScratch(Scratch, Capacity)) {
+        free(Scratch);
+        return NULL;
+    }
+    return Scratch;
+}
+
+void
+GifFreeQuantizeScratch(GifQuantizeScratch *Scratch) {
+
+    if (Scratch == NULL)
+        return;
+    free(Scratch->Base);
+    free(Scratch);
+}
+
+/******************************************************************************
+ A color map shared by many images.  The images are added to one histogram
+ first, the color map is built from it once, and then every image is mapped
+ through it.  The histogram is always dense, as the number of pixels that
+ will be added is not known up front.
+******************************************************************************/
+struct GifQuantizePalette {
+    GifQuantizePalette(const GifQuantizeOptions * Options) {
+        DitherMode = Options != NULL ? Options->DitherMode : GIF_DITHER_NONE;
+        SampleStride = Options != NULL ? Options->SampleStride : 0;
+        SampleSeed = Options != NULL ? Options->SampleSeed : 0;
+        Table.Base = Rows.Base = NULL;
+        Table.Capacity = Table.Used = Rows.Capacity = Rows.Used = 0;
+    }
+    virtual ~GifQuantizePalette() {
+        free(Table.Base);
+        free(Rows.Base);
+    }
+
+    virtual void Reset() = 0;
+    virtual int Add(unsigned long NumPixels,
+                    const GifByteType * RedInput,
+                    const GifByteType * GreenInput,
+                    const GifByteType * BlueInput) = 0;
+    virtual int Build(int *ColorMapSize, GifColorType * OutputColorMap) = 0;
+    virtual int Map(unsigned int Width, unsigned int Height,
+                    const GifByteType * RedInput,
+                    const GifByteType * GreenInput,
+                    const GifByteType * BlueInput,
+                    GifByteType * OutputBuffer) = 0;
+
+    int DitherMode;
+    unsigned int SampleStride, SampleSeed;
+    GifQuantizeScratch Table, Rows;
+};
+
+template <int Bits>
+class QuantizePalette : public GifQuantizePalette {
+public:
+    typedef QuantizeBits<Bits> Traits;
+
+    QuantizePalette(const GifQuantizeOptions * Options)
+        : GifQuantizePalette(Options) {}
+
+    bool Init() {
+        if (!ReserveScratch(&Table,
+                DenseHistogram<Bits>::ScratchSize(0) +
+                ScratchBytes(sizeof(QuantizedColorType *) *
+                             Traits::ColorArraySize)))
+            return false;
+        Reset();
+        return true;
+    }
+
+    virtual void Reset() {
+        Table.Used = 0;
+        Histogram.Init(0, &Table);
+        SortArray = (QuantizedColorType **)ScratchAlloc(&Table,
+                       sizeof(QuantizedColorType *) * Traits::ColorArraySize);
+        Seed = SampleSeed;
+        NumSamples = 0;
+        ColorMapSize = 0;
+    }
+
+    virtual int Add(unsigned long NumPixels,
+                    const GifByteType * RedInput,
+                    const GifByteType * GreenInput,
+                    const GifByteType * BlueInput) {
+        unsigned int Stride = SampleStride;
+
+        if (ColorMapSize != 0)
+            return GIF_ERROR;
+        if (Stride == 0)
+            Stride = std::max<unsigned long>(1,
+                        NumPixels / GIF_PALETTE_AUTO_SAMPLES);
+        NumSamples += SampleHistogram<Bits>(Histogram, NumPixels, RedInput,
+                                            GreenInput, BlueInput, NULL,
+                                            Stride, &Seed);
+        return GIF_OK;
+    }
+
+    virtual int Build(int *Size, GifColorType * OutputColorMap) {
+        int RequestedSize = *Size;
+
+        if (ColorMapSize != 0 ||
+            BuildColorMap<Bits>(Histogram, NumSamples, SortArray, Size,
+                                ColorMap) != GIF_OK)
+            return GIF_ERROR;
+        ColorMapSize = *Size;
+        memcpy(OutputColorMap, ColorMap,
+               sizeof(GifColorType) * RequestedSize);
+        return GIF_OK;
+    }
+
+    virtual int Map(unsigned int Width, unsigned int Height,
+                    const GifByteType * RedInput,
+                    const GifByteType * GreenInput,
+                    const GifByteType * BlueInput,
+                    GifByteType * OutputBuffer) {
+        if (ColorMapSize == 0 ||
+            !ReserveScratch(&Rows, MapScratchSize(Width, DitherMode)))
+            return GIF_ERROR;
+        return MapImage<Bits>(Histogram, Width, Height, RedInput, GreenInput,
+                              BlueInput, OutputBuffer, ColorMap,
+                              ColorMapSize, NULL, DitherMode, &Rows);
+    }
+
+private:
+    DenseHistogram<Bits> Histogram;
+    QuantizedColorType **SortArray;
+    unsigned long NumSamples;
+    unsigned int Seed;
+    int ColorMapSize;
+    GifColorType ColorMap[256];
+};
+
+/******************************************************************************
+ Start a color map shared by many images, with the precision, dithering and
+ sampling of Options (NULL for the defaults).  SampleStride zero, the
+ default, samples about GIF_PALETTE_AUTO_SAMPLES pixels of every image, as
+ a histogram of every pixel of a long clip is mostly wasted work.
+   Returns NULL if out of memory or if the precision is not supported.
+******************************************************************************/
+GifQuantizePalette *
+GifNewQuantizePalette(const GifQuantizeOptions * Options) {
+
+    int BitsPerPrimColor = Options != NULL ? Options->BitsPerPrimColor
+                                           : GIF_QUANTIZE_DEFAULT_BITS;
+    GifQuantizePalette *Palette;
+    bool Ok;
+
+    switch (BitsPerPrimColor) {
+      case 4: {
+        QuantizePalette<4> *Typed = new (std::nothrow) QuantizePalette<4>(Options);
+        Ok = Typed != NULL && Typed->Init();
+        Palette = Typed;
+        break;
+      }
+      case 5: {
+        QuantizePalette<5> *Typed = new (std::nothrow) QuantizePalette<5>(Options);
+        Ok = Typed != NULL && Typed->Init();
+        Palette = Typed;
+        break;
+      }
+      case 6: {
+        QuantizePalette<6> *Typed = new (std::nothrow) QuantizePalette<6>(Options);
+        Ok = Typed != NULL && Typed->Init();
+        Palette = Typed;
+        break;
+      }
+      default:
+        return NULL;
+    }
+
+    if (!Ok) {
+        delete Palette;
+        return NULL;
+    }
+    return Palette;
+}
+
+/* Forget every image added and the color map built, keeping the memory. */
+void
+GifQuantizePaletteReset(GifQuantizePalette *Palette) {
+
+    Palette->Reset();
+}
+
+/******************************************************************************
+ Add the pixels of an image, given as in GifQuantizeBuffer, to the histogram
+ of Palette.  Fails once the color map is built.
+******************************************************************************/
+int
+GifQuantizePaletteAdd(GifQuantizePalette *Palette,
+                      unsigned int Width,
+                      unsigned int Height,
+                      const GifByteType * RedInput,
+                      const GifByteType * GreenInput,
+                      const GifByteType * BlueInput) {
+
+    return Palette->Add(((unsigned long)Width) * Height, RedInput,
+                        GreenInput, BlueInput);
+}
+
+/******************************************************************************
+ Build the color map of all images added, of at most *ColorMapSize colors,
+ into OutputColorMap.  *ColorMapSize is updated to the real size and the
+ rest of OutputColorMap up to the requested size is cleared.
+******************************************************************************/
+int
+GifQuantizePaletteBuild(GifQuantizePalette *Palette,
+                        int *ColorMapSize,
+                        GifColorType * OutputColorMap) {
+
+    if (*ColorMapSize < 1 || *ColorMapSize > 256)
+        return GIF_ERROR;
+    return Palette->Build(ColorMapSize, OutputColorMap);
+}
+
+/******************************************************************************
+ Map an image through the color map built, into OutputBuffer.  The image
+ need not be one of those added.
+******************************************************************************/
+int
+GifQuantizePaletteMap(GifQuantizePalette *Palette,
+                      unsigned int Width,
+                      unsigned int Height,
+                      const GifByteType * RedInput,
+                      const GifByteType * GreenInput,
+                      const GifByteType * BlueInput,
+                      GifByteType * OutputBuffer) {
+
+    return Palette->Map(Width, Height, RedInput, GreenInput, BlueInput,
+                        OutputBuffer);
+}
+
+void
+GifFreeQuantizePalette(GifQuantizePalette *Palette) {
+
+    delete Palette;
+}
+
+int
+GifQuantizeBuffer(unsigned int Width,
+               unsigned int Height,
+               int *ColorMapSize,
+               GifByteType * RedInput,
+               GifByteType * GreenInput,
+               GifByteType * BlueInput,
+               GifByteType * OutputBuffer,
+               GifColorType * OutputColorMap) {
+
+    return GifQuantizeBufferEx(Width, Height, ColorMapSize, RedInput,
+                               GreenInput, BlueInput, OutputBuffer,
+                               OutputColorMap, NULL);
+}
+
+/******************************************************************************
+ Drop the entries of a color map of *ColorMapSize colors that no pixel of
+ the NumPixels indexes in IndexBuffer uses.  The entries left keep their
+ order and move down over the gaps, the indexes are remapped to match and
+ *ColorMapSize is updated; the freed tail of the color map is cleared.  An
+ entry after the colors, such as the transparent one, stays the last if it
+ is used.  Dithering leaves entries unused that median cut made, and every
+ one dropped can halve the table the image needs.  The permutation itself
+ is free to LZW, it matches strings of indexes whatever their values.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int
+GifPruneColorMap(unsigned long NumPixels,
+                 GifByteType * IndexBuffer,
+                 int *ColorMapSize,
+                 GifColorType * ColorMap) {
+
+    /* Four tables of counts, so runs of one index do not wait on the
+     * increment before: */
+    unsigned long Counts[4][256];
+    GifByteType Translation[256];
+    unsigned long i;
+    int j, NewColorMapSize = 0;
+
+    if (*ColorMapSize < 1 || *ColorMapSize > 256)
+        return GIF_ERROR;
+
+    for (j = 0; j < 256; j++)
+        Translation[j] = j;
+    memset(Counts, 0, sizeof(Counts));
+    for (i = 0; i + 4 <= NumPixels; i += 4) {
+        Counts[0][IndexBuffer[i]]++;
+        Counts[1][IndexBuffer[i + 1]]++;
+        Counts[2][IndexBuffer[i + 2]]++;
+        Counts[3][IndexBuffer[i + 3]]++;
+    }
+    for (; i < NumPixels; i++)
+        Counts[0][IndexBuffer[i]]++;
+
+    for (j = 0; j < *ColorMapSize; j++) {
+        if (Counts[0][j] + Counts[1][j] + Counts[2][j] + Counts[3][j] == 0)
+            continue;
+        Translation[j] = NewColorMapSize;
+        ColorMap[NewColorMapSize++] = ColorMap[j];
+    }
+    if (NewColorMapSize == *ColorMapSize)
+        return GIF_OK;
+
+    for (i = 0; i < NumPixels; i++)
+        IndexBuffer[i] = Translation[IndexBuffer[i]];
+    memset(&ColorMap[NewColorMapSize], 0,
+           sizeof(GifColorType) * (*ColorMapSize - NewColorMapSize));
+    *ColorMapSize = NewColorMapSize;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Measure how far a quantized image is from its input.  The input is given
+ as in GifQuantizeBuffer, the output as the index buffer and color map it
+ produced.  This is a separate pass so that quantizing does not pay for it;
+ call it only when the numbers are wanted.
+   PSNR is over all three channels and is GIF_PSNR_IDENTICAL when the images
+ are identical.  SSIM is the mean over 8x8 windows of the luma, or over the
+ whole image if it is smaller than one window.
+   GifQuantizeMetricsRows adds rows FirstRow to EndRow - 1 of the image into
+ Sums, which start zeroed, and GifQuantizeMetricsReport turns the sums of
+ all rows into the report, so bands of rows can be measured on several
+ threads, each into sums of its own.  A band takes the SSIM windows whose
+ top row is in it.  GifQuantizeMetrics does the whole image at once.
+   These functions return GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+#define SSIM_WINDOW 8
+
+static int
+LumaOf(int Red, int Green, int Blue) {
+    return (Red * 77 + Green * 150 + Blue * 29) >> 8;
+}
+
+int
+GifQuantizeMetricsRows(unsigned int Width,
+                       unsigned int Height,
+                       unsigned int FirstRow,
+                       unsigned int EndRow,
+                       const GifByteType * RedInput,
+                       const GifByteType * GreenInput,
+                       const GifByteType * BlueInput,
+                       const GifByteType * IndexBuffer,
+                       const GifColorType * ColorMap,
+                       GifQuantizeSums * Sums) {
+
+    const double C1 = (0.01 * 255) * (0.01 * 255),
+                 C2 = (0.03 * 255) * (0.03 * 255);
+    unsigned int x, y, wx, wy, WindowWidth, WindowHeight;
+
+    if (Width == 0 || Height == 0 || EndRow > Height || FirstRow > EndRow
+        || Sums == NULL)
+        return GIF_ERROR;
+
+    /* Squared and maximal error, one row at a time so the loop stays
+     * simple enough to vectorize: */
+    for (y = FirstRow; y < EndRow; y++) {
+        const GifByteType *Red = RedInput + y * Width;
+        const GifByteType *Green = GreenInput + y * Width;
+        const GifByteType *Blue = BlueInput + y * Width;
+        const GifByteType *Index = IndexBuffer + y * Width;
+        unsigned long RowError = 0;
+
+        for (x = 0; x < Width; x++) {
+            const GifColorType *Color = &ColorMap[Index[x]];
+            int DRed = ABS(Color->Red - Red[x]);
+            int DGreen = ABS(Color->Green - Green[x]);
+            int DBlue = ABS(Color->Blue - Blue[x]);
+
+            RowError += DRed * DRed + DGreen * DGreen + DBlue * DBlue;
+            Sums->MaxError[0] = std::max(Sums->MaxError[0], DRed);
+            Sums->MaxError[1] = std::max(Sums->MaxError[1], DGreen);
+            Sums->MaxError[2] = std::max(Sums->MaxError[2], DBlue);
+        }
+        Sums->SquaredError += RowError;
+    }
+    Sums->NumPixels += (unsigned long)(EndRow - FirstRow) * Width;
+
+    /* Structural similarity of the luma, window by window, for the windows
+     * starting in the band: */
+    WindowWidth = std::min<unsigned int>(SSIM_WINDOW, Width);
+    WindowHeight = std::min<unsigned int>(SSIM_WINDOW, Height);
+    wy = (FirstRow + WindowHeight - 1) / WindowHeight * WindowHeight;
+    for (; wy < EndRow && wy + WindowHeight <= Height; wy += WindowHeight) {
+        for (wx = 0; wx + WindowWidth <= Width; wx += WindowWidth) {
+            long SumIn = 0, SumOut = 0, SumInSq = 0, SumOutSq = 0, SumCross = 0;
+            double N = WindowWidth * WindowHeight, MeanIn, MeanOut, VarIn,
+                   VarOut, Covar;
+
+            for (y = wy; y < wy + WindowHeight; y++) {
+                for (x = wx; x < wx + WindowWidth; x++) {
+                    unsigned int i = y * Width + x;
+                    const GifColorType *Color = &ColorMap[IndexBuffer[i]];
+                    int In = LumaOf(RedInput[i], GreenInput[i], BlueInput[i]);
+                    int Out = LumaOf(Color->Red, Color->Green, Color->Blue);
+
+                    SumIn += In;
+                    SumOut += Out;
+                    SumInSq += In * In;
+                    SumOutSq += Out * Out;
+                    SumCross += In * Out;
+                }
+            }
+
+            MeanIn = SumIn / N;
+            MeanOut = SumOut / N;
+            VarIn = SumInSq / N - MeanIn * MeanIn;
+            VarOut = SumOutSq / N - MeanOut * MeanOut;
+            Covar = SumCross / N - MeanIn * MeanOut;
+            Sums->SSIMSum += ((2 * MeanIn * MeanOut + C1) * (2 * Covar + C2)) /
+                             ((MeanIn * MeanIn + MeanOut * MeanOut + C1) *
+                              (VarIn + VarOut + C2));
+            Sums->NumWindows++;
+        }
+    }
+
+    return GIF_OK;
+}
+
+int
+GifQuantizeMetricsReport(const GifQuantizeSums * Sums,
+                         int SumCount,
+                         GifQuantizeReport * Report) {
+
+    unsigned long long SquaredError = 0;
+    unsigned long NumPixels = 0, NumWindows = 0;
+    double SSIMSum = 0.0;
+    int i, j;
+
+    if (Sums == NULL || SumCount < 1 || Report == NULL)
+        return GIF_ERROR;
+
+    /* In order of the bands, so the sum does not depend on the threads: */
+    memset(Report->MaxError, 0, sizeof(Report->MaxError));
+    for (i = 0; i < SumCount; i++) {
+        SquaredError += Sums[i].SquaredError;
+        NumPixels += Sums[i].NumPixels;
+        SSIMSum += Sums[i].SSIMSum;
+        NumWindows += Sums[i].NumWindows;
+        for (j = 0; j < 3; j++)
+            Report->MaxError[j] = std::max(Report->MaxError[j],
+                                           Sums[i].MaxError[j]);
+    }
+    if (NumPixels == 0 || NumWindows == 0)
+        return GIF_ERROR;
+
+    if (SquaredError == 0)
+        Report->PSNR = GIF_PSNR_IDENTICAL;
+    else
+        Report->PSNR = 10.0 * log10(255.0 * 255.0 * 3.0 * NumPixels /
+                                    (double)SquaredError);
+    Report->SSIM = SSIMSum / NumWindows;
+
+    return GIF_OK;
+}
+
+int
+GifQuantizeMetrics(unsigned int Width,
+                   unsigned int Height,
+                   const GifByteType * RedInput,
+                   const GifByteType * GreenInput,
+                   const GifByteType * BlueInput,
+                   const GifByteType * IndexBuffer,
+                   const GifColorType * ColorMap,
+                   GifQuantizeReport * Report) {
+
+    GifQuantizeSums Sums;
+
+    memset(&Sums, 0, sizeof(Sums));
+    if (GifQuantizeMetricsRows(Width, Height, 0, Height, RedInput,
+                               GreenInput, BlueInput, IndexBuffer, ColorMap,
+                               &Sums) == GIF_ERROR)
+        return GIF_ERROR;
+    return GifQuantizeMetricsReport(&Sums, 1, Report);
+}
+
+/* end */
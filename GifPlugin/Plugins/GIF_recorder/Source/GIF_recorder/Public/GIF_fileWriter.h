@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include "gif_lib.h"
+#include "Containers/Array.h"
+#include "Containers/UnrealString.h"
+#include "Async/Future.h"
+
+/* Output of a gif file in large chunks. A full chunk is written on a thread pool thread while the next one fills,
+   into a temporary file next to the file, which replaces the file only once it is complete */
+class GIF_fileWriter
+{
+public:
+	GIF_fileWriter();
+	~GIF_fileWriter();
+
+	/* Bytes gathered before they go to disk in one write. Two chunks of this size are held while a file is open */
+	int32 ChunkSize = 4 * 1024 * 1024;
+
+	/* Start a file at FilePath, written to FilePath.tmp until Close. Returns false if it cannot be created */
+	bool Open(const std::string& FilePath);
+	bool IsOpen() const { return File != nullptr; }
+	/* Reserve about Bytes of disk for the file up front without writing them, so it does not grow write by write */
+	void Preallocate(int64 Bytes);
+	/* Add Length bytes to the file. Returns false once a write has failed */
+	bool Write(const uint8* Bytes, int32 Length);
+	/* Write what is left and put the file in place if bKeep is set and every write went through, else delete it. Returns true if the file is in place */
+	bool Close(bool bKeep);
+	/* OutputFunc of EGifOpen, with the writer as user data */
+	static int GifOutput(GifFileType* GifFile, const GifByteType* Bytes, int Length);
+
+	/* Bytes, chunks and time spent waiting for the disk of the last file */
+	int64 GetBytesWritten() const { return BytesWritten; }
+	int32 GetChunkCount() const { return ChunkCount; }
+	double GetWaitSeconds() const { return WaitSeconds; }
+
+private:
+	/* Hand the filling chunk to the I/O thread and start filling the other one */
+	void Flush();
+	/* Wait until the chunk being written is on disk, which frees it */
+	void WaitForWrite();
+
+	/* Paths of the file and of its temporary file, opened, moved and deleted by these same wide names */
+	FString FinalPath;
+	FString TempPath;
+	FILE* File = nullptr;
+	/* One chunk fills while the other is written, their capacity is kept across files */
+	TArray<uint8> Chunks[2];
+	int32 FillingChunk = 0;
+	TFuture<bool> PendingWrite;
+	bool bFailed = false;
+	int64 BytesWritten = 0;
+	int64 Preallocated = 0;
+	int32 ChunkCount = 0;
+	double WaitSeconds = 0.0;
+};
@@ -3,13 +3,27 @@
 #include <vector>
 
 #include "gif_lib.h"
+#include "GIF_fileWriter.h"
 #include "Engine/TextureRenderTarget2D.h"
 #include "Containers/UnrealString.h"
 #include "Containers/Ticker.h"
 #include "Engine/SceneCapture2D.h"
+#include "Async/Future.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/CriticalSection.h"
 
 typedef unsigned char GifByteType;
 
+/* How the last save ended */
+enum class EGIFSaveResult : uint8
+{
+	None,
+	Saved,
+	Cancelled,
+	Failed
+};
+
 class GIF_frameCapture
 {
 public:
@@ -20,9 +34,59 @@ public:
 	TArray<UTexture2D*> AllFrames;
 	/* Lance Comment: Frame rate for gif capture */
 	float FPS = 1.0f / 15.0f;
+	/* Histogram precision of the quantizer, 4, 5 or 6 bits per channel */
+	int32 QuantizeBits = GIF_QUANTIZE_DEFAULT_BITS;
+	/* GIF_DITHER_NONE, GIF_DITHER_ORDERED or GIF_DITHER_FLOYD_STEINBERG */
+	int32 DitherMode = GIF_DITHER_NONE;
+	/* Largest color table, 2 to 256 rounded down to a power of two, the transparent color included */
+	int32 MaxColors = 256;
+	/* Share one color map across the whole clip instead of one per frame */
+	bool bGlobalPalette = false;
+	/* Compress the frames in parallel, to the same file as a serial save at EncodeStrips 1 and LossyError 0 */
+	bool bParallelEncode = true;
+	/* With bParallelEncode, strips of rows each frame is cut into and compressed apart, 1 or more */
+	int32 EncodeStrips = 1;
+	/* GIF_COMPRESS_FAST, GIF_COMPRESS_BALANCED or GIF_COMPRESS_MAX */
+	int32 CompressLevel = GIF_COMPRESS_FAST;
+	/* With bParallelEncode, RGB distance a pixel may be moved to lengthen LZW strings, 0 for exact */
+	int32 LossyError = 0;
+	/* Write only the rectangle of each frame that changed since the last one */
+	bool bCropToChanges = true;
+	/* Leave pixels that match what shows already transparent */
+	bool bTransparentDelta = true;
+	/* With bTransparentDelta, largest channel difference, 0 to 255, at which a pixel still counts as unchanged */
+	int32 TransparentTolerance = 0;
+	/* Drop frames that match the frame before them and show that one longer */
+	bool bMergeDuplicateFrames = true;
+	/* With bMergeDuplicateFrames, largest channel difference, 0 to 255, at which a pixel still counts as the same */
+	int32 DuplicatePixelTolerance = 0;
+	/* With bMergeDuplicateFrames, share of pixels, 0 to 1, that may differ in a merged frame */
+	float DuplicateFrameTolerance = 0.0f;
+	/* Quantize, compress and write one frame at a time instead of the whole clip at once */
+	bool bStreamFrames = false;
+	/* Write through a background thread into a temporary file that replaces the gif once complete */
+	bool bBufferedWrite = true;
+	/* Measure PSNR, max error and SSIM of every saved frame into QualityReports */
+	bool bComputeQualityMetrics = false;
+	/* Per-frame quality of the last save, in frame order, empty unless bComputeQualityMetrics is set */
+	TArray<GifQuantizeReport> QualityReports;
 	
 	/* Lance Comment: Save recorded frames to gif */
 	void SaveGIF(std::string pathName, int32 startFrame, int32 endFrame);
+	/* Save recorded frames to gif on a thread of its own, from a copy of them taken now. Returns false if a save runs already or there is nothing to save */
+	bool SaveGIFAsync(std::string pathName, int32 startFrame, int32 endFrame);
+	/* Encode recorded frames to gif into Bytes instead of a file, to write at once, hash or hand on. Returns false if it failed, a save runs already or there is nothing to save */
+	bool SaveGIFToMemory(int32 startFrame, int32 endFrame, TArray<uint8>& Bytes);
+	/* Stop the running save at the next frame, the file is deleted */
+	void CancelSave();
+	bool IsSaving() const { return bSaving; }
+	/* Frames of the running save quantized so far, out of GetSaveFrameTotal, which is 0 until the frames to write are known */
+	int32 GetSavedFrameCount() const { return SavedFrameCount.GetValue(); }
+	int32 GetSaveFrameTotal() const { return SaveFrameTotal.GetValue(); }
+	/* Outcome, file size and time of the last save, once it is over. Safe to call from any thread */
+	EGIFSaveResult GetLastSaveResult() const;
+	int64 GetLastSaveBytes() const;
+	double GetLastSaveSeconds() const;
 
 	bool GetRecording() { return IsRecording; }
 	bool StartRecording();
@@ -58,11 +122,106 @@ private:
 
 	/* Mad comment: GIF saving */
 	GifFileType* GifFile = nullptr;
+	/* The frames of the current save and their size, copied from the recording so it can go on while they are written */
+	std::vector<std::vector<GifByteType>> SaveRed;
+	std::vector<std::vector<GifByteType>> SaveGreen;
+	std::vector<std::vector<GifByteType>> SaveBlue;
+	int SaveWidth = 0;
+	int SaveHeight = 0;
+	/* Copy frames startFrame to endFrame into the snapshot and reset the progress. Returns false if none of them is recorded */
+	bool TakeSaveSnapshot(int32 startFrame, int32 endFrame);
+	/* Write the snapshot to pathName, or into Bytes unless it is null, the body of SaveGIF, SaveGIFAsync and SaveGIFToMemory */
+	void WriteGIF(std::string pathName, TArray<uint8>* Bytes);
+	/* Buffer of an in-memory save and the count of writes into it, the user data of its GifFile */
+	struct FMemoryOutput
+	{
+		TArray<uint8>* Bytes = nullptr;
+		int32 WriteCount = 0;
+	};
+	FMemoryOutput MemoryOutput;
+	/* Output of the file saves with bBufferedWrite */
+	GIF_fileWriter FileWriter;
+	/* Size of the last in-memory save, reserved up front by the next one */
+	int64 LastMemoryBytes = 0;
+	/* OutputFunc of EGifOpen appending to MemoryOutput */
+	static int WriteToMemory(GifFileType* GifFile, const GifByteType* Bytes, int Length);
+	/* Record how the save ended, delete the file of a cancelled one and free the snapshot */
+	void FinishSave(const std::string& filePath, EGIFSaveResult Result, double SaveStart);
+	TFuture<void> SaveTask;
+	FThreadSafeBool bSaving;
+	FThreadSafeBool bCancelSave;
+	FThreadSafeCounter SavedFrameCount;
+	FThreadSafeCounter SaveFrameTotal;
+	/* Set by the save worker and read by the UI, so only under LastSaveLock */
+	mutable FCriticalSection LastSaveLock;
+	EGIFSaveResult LastSaveResult = EGIFSaveResult::None;
+	int64 LastSaveBytes = 0;
+	double LastSaveSeconds = 0.0;
+	void SetLastSave(EGIFSaveResult Result, int64 Bytes, double Seconds);
+	/* Time spent in the quantizer during the current save */
+	double QuantizeSeconds = 0.0;
+	/* Quality metrics of a frame are measured in bands of this many rows, a multiple of the 8 rows of an SSIM window */
+	static const int32 MetricsBandRows = 64;
+	TArray<GifQuantizeSums> MetricsSums;
+	/* Colors of the current save dropped from frame color maps because no pixel used them */
+	int32 PrunedColors = 0;
+	/* Quantizer work memory, kept across frames and saves so quantizing a frame does not allocate */
+	GifQuantizeScratch* QuantizeScratch = nullptr;
+	/* Frame array of the current save, allocated by giflib and kept across saves, EGifCloseFile leaves it alone */
+	SavedImage* SavedImages = nullptr;
+	int SavedImageCapacity = 0;
+	/* Extension block arrays of every frame, malloc'd like giflib's own and kept across saves */
+	static const int32 ExtensionsPerFrame = 3;
+	TArray<ExtensionBlock*> ExtensionArrays;
+	/* Rasters, color maps and extension bytes of the current save. EGifSpew only reads them, so they are sized once per save instead of allocated per frame */
+	TArray<GifByteType> RasterStorage;
+	TArray<ColorMapObject> ColorMapStorage;
+	TArray<GifColorType> ColorStorage;
+	TArray<GifByteType> ExtensionBytes;
+	/* Size the storage above for FrameCount frames and hand it to GifFile. Returns false if the frame or extension arrays could not be allocated */
+	bool ReserveSaveStorage(int32 FrameCount, int ImageWidth, int ImageHeight);
+	/* Image data of every frame, compressed by CompressFrames. The buffers are kept across saves */
+	TArray<GifCompressedImage> CompressedImages;
+	/* Strips of every frame when EncodeStrips is above 1, frame by frame */
+	TArray<GifCodeStrip> CodeStrips;
+	/* Strips of every frame still to compress, the worker taking it to 0 joins them */
+	TArray<FThreadSafeCounter> StripsLeft;
+	/* LZW encoders of the CompressFrames workers, one per worker, kept across frames and saves since each holds over 4 MB of tables */
+	TArray<GifRasterEncoder*> EncoderPool;
+	/* Compress all frames of GifFile into CompressedImages on the task graph workers */
+	bool CompressFrames();
+	/* Write the screen descriptor and the kept frames to GifFile, each as soon as it is quantized */
+	bool StreamFrames();
+	/* Recorded frames of the current save that are written, and how many recorded frames each one shows for */
+	TArray<int32> KeptFrames;
+	TArray<int32> FrameSpans;
+	/* Fill KeptFrames and FrameSpans from frames startFrame to endFrame, merging duplicates if bMergeDuplicateFrames is set */
+	void MergeDuplicateFrames(int32 startFrame, int32 endFrame);
+	/* Frames appended during the current save, the first one carries the loop block */
+	int32 AppendedFrames = 0;
+	/* Red, green and blue of the last frame appended, the one the next is compared with */
+	const GifByteType* PreviousPlanes[3] = { nullptr, nullptr, nullptr };
+	/* The changed rectangle of a frame, copied out to quantize it */
+	TArray<GifByteType> CropStorage;
+	/* Red, green and blue planes of the pixels last written, what shows after the last frame, with bTransparentDelta */
+	TArray<GifByteType> CanvasStorage;
+	/* Pixels of the changed rectangle left transparent, with bTransparentDelta */
+	TArray<GifByteType> TransparentMask;
+	/* Index of the transparent color in the global palette */
+	int GlobalTransparentIndex = 0;
+	/* Color map shared by all frames of the current save when bGlobalPalette is set */
+	GifQuantizePalette* GlobalPalette = nullptr;
+	GifQuantizeOptions MakeQuantizeOptions() const;
+	/* MaxColors clamped to 2 to 256 and rounded down to a power of two */
+	int GetColorLimit() const;
+	/* Build GlobalPalette from frames startFrame to endFrame and make it the screen color map of GifFile */
+	bool BuildGlobalPalette(int32 startFrame, int32 endFrame, int ImageWidth, int ImageHeight);
 	/* Lance comment: Setup first data blocks for gif image, mainly just sets the width and height of the image. */
 	void SetupGif(int ImageWidth, int ImageHeight);
 	/* Lance comment: Appends a frame to our in memory gif structure (GifFile) */
 	void AppendFrameToGif(std::vector<GifByteType>& RedChannel, 
 	                      std::vector<GifByteType>& GreenChannel,
-	                      std::vector<GifByteType>& BlueChannel);
+	                      std::vector<GifByteType>& BlueChannel,
+	                      int32 FrameSpan);
 };
 
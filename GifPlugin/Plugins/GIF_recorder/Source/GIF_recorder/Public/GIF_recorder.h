@@ -24,6 +24,8 @@ class UTexture2D;
 class SImage;
 class SDockTab;
 
+DECLARE_LOG_CATEGORY_EXTERN(LogGIFRecorder, Log, All);
+
 class FGIF_recorderModule : public IModuleInterface
 {
 public:
@@ -38,6 +40,7 @@ public:
 
 	/** Seb comment: Function for what to do when pressing the save button**/
 	FReply SaveButtonClicked();
+	FReply CancelSaveButtonClicked();
 	FReply SelectPathButtonClicked();
 	void OnViewportTabClosed(TSharedRef<SDockTab> ClosedTab);
 
@@ -53,6 +56,9 @@ private:
 	const FSlateBrush* GetMainScreenBrush() const;
 	void OnPathTextCommitted(const FText& InText, ETextCommit::Type InCommitType);
 	FText GetPathText() const;
+	/** Whether a save runs, and how far it got or how the last one ended **/
+	bool IsSaving() const;
+	FText GetSaveStatusText() const;
 
 
 	void AddToolbarExtension(FToolBarBuilder& Builder);
@@ -18,29 +18,49 @@ gif_hash.h - magfic constants and declarations for GIF LZW
 #include <stdint.h>
 #include "winhlpr.h"
 
-#define HT_SIZE			8192	   /* 12bits = 4096 or twice as big! */
-#define HT_KEY_MASK		0x1FFF			      /* 13bits keys */
-#define HT_KEY_NUM_BITS		13			      /* 13bits keys */
-#define HT_MAX_KEY		8191	/* 13bits - 1, maximal code possible */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 #define HT_MAX_CODE		4095	/* Biggest code possible in 12 bits. */
+#define HT_NUM_PREFIXES		4096	/* Every 12 bits prefix code... */
+#define HT_NUM_SUFFIXES		256	/* ...times every 8 bits postfix char. */
+#define HT_SIZE			(HT_NUM_PREFIXES * HT_NUM_SUFFIXES)
+
+/* The key is 12 bits Prefix code + new char of the code size of the image */
+/* (8 bits at most, so 20 bits), and indexes the table directly, so every  */
+/* lookup and insert is a single probe.  Images of fewer bits use only the */
+/* start of the table.							    */
+/* Every slot is tagged with the generation it was filled in: clearing the */
+/* table just starts a new generation, and slots of older ones read as     */
+/* empty.  The generation is the upper 20 bits and the code the lower 12.  */
+#define HT_GET_GENERATION(l)	((l) >> 12)
+#define HT_GET_CODE(l)		((l) & 0x0FFF)
+#define HT_PUT_GENERATION(l)	((l) << 12)
+#define HT_PUT_CODE(l)		((l) & 0x0FFF)
+#define HT_MAX_GENERATION	0xFFFFF	/* Then the table is really wiped */
 
-/* The 32 bits of the long are divided into two parts for the key & code:   */
-/* 1. The code is 12 bits as our compression algorithm is limited to 12bits */
-/* 2. The key is 12 bits Prefix code + 8 bit new char or 20 bits.	    */
-/* The key is the upper 20 bits.  The code is the lower 12. */
-#define HT_GET_KEY(l)	(l >> 12)
-#define HT_GET_CODE(l)	(l & 0x0FFF)
-#define HT_PUT_KEY(l)	(l << 12)
-#define HT_PUT_CODE(l)	(l & 0x0FFF)
+/* Strings of one pixel repeated are also remembered by their length, so   */
+/* the encoder can walk a run of that pixel without a lookup per pixel.    */
+/* Such strings enter the table in order of length, so for every pixel it  */
+/* is enough to know the longest one and the codes of all of them, which   */
+/* grow with the length.						    */
+#define HT_RUN_CAP		256	/* Longest run string remembered */
 
 typedef struct GifHashTableType {
     uint32_t HTable[HT_SIZE];
+    uint32_t Generation;	/* Only slots of this generation are full */
+    uint16_t RunTop[256];	/* Longest run string of every pixel */
+    uint16_t RunTopCode[256];	/* And its code, kept apart for the inserts */
+    uint16_t RunCodes[256][HT_RUN_CAP + 1];	/* Their codes, by length */
 } GifHashTableType;
 
 GifHashTableType *_InitHashTable(void);
 void _ClearHashTable(GifHashTableType *HashTable);
-void _InsertHashTable(GifHashTableType *HashTable, uint32_t Key, int Code);
-int _ExistsHashTable(GifHashTableType *HashTable, uint32_t Key);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
 
 #endif /* _GIF_HASH_H_ */
 
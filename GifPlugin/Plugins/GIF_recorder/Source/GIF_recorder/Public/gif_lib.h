@@ -87,6 +87,7 @@ typedef struct GifFileType {
     int ImageCount;                  /* Number of current image (both APIs) */
     GifImageDesc Image;              /* Current image (low-level API) */
     SavedImage *SavedImages;         /* Image sequence (high-level API) */
+    int SavedImageCapacity;          /* Images SavedImages has room for */
     int ExtensionBlockCount;         /* Count extensions past last image */
     ExtensionBlock *ExtensionBlocks; /* Extensions past last image */    
     int Error;			     /* Last error condition reported */
@@ -104,6 +105,28 @@ typedef enum {
     TERMINATE_RECORD_TYPE   /* Begin with ';' */
 } GifRecordType;
 
+/* Image data compressed apart from the file, by EGifCompressRaster */
+typedef struct GifCompressedImage {
+    GifByteType *Bytes;     /* Code size, sub-blocks and terminator, malloc(3) */
+    size_t Length;          /* Bytes of image data */
+    size_t Size;            /* Bytes allocated */
+    int ClearCount;         /* Dictionary resets while compressing */
+    unsigned long LossyPixels;  /* Pixels written as a near color */
+} GifCompressedImage;
+
+/* Codes of one strip of an image, by EGifCompressStrip */
+typedef struct GifCodeStrip {
+    GifByteType *Bytes;     /* Codes, low bits first, on malloc(3) heap */
+    size_t BitCount;        /* Bits of codes */
+    size_t Size;            /* Bytes allocated */
+    int BitsPerPixel;       /* Code size of the image */
+    int EndBits;            /* Width of the code after the strip */
+    int ClearCount;         /* Dictionary resets inside the strip */
+    unsigned long LossyPixels;  /* Pixels written as a near color */
+} GifCodeStrip;
+
+typedef struct GifRasterEncoder GifRasterEncoder;
+
 /* func type to read gif data from arbitrary sources (TVT) */
 typedef int (*InputFunc) (GifFileType *, GifByteType *, int);
 
@@ -138,6 +161,8 @@ MODULE_API GifFileType *EGifOpenFileName(const char *GifFileName,
 MODULE_API GifFileType *EGifOpenFileHandle(const int GifFileHandle, int *Error);
 MODULE_API GifFileType *EGifOpen(void *userPtr, OutputFunc writeFunc, int *Error);
 MODULE_API int EGifSpew(GifFileType * GifFile);
+MODULE_API int EGifSpewCompressed(GifFileType * GifFile,
+                                  const GifCompressedImage *Images);
 MODULE_API const char *EGifGetGifVersion(GifFileType *GifFile); /* new in 5.x */
 MODULE_API int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 
@@ -152,6 +177,7 @@ MODULE_API int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 #define E_GIF_ERR_DISK_IS_FULL   8
 #define E_GIF_ERR_CLOSE_FAILED   9
 #define E_GIF_ERR_NOT_WRITEABLE  10
+#define E_GIF_ERR_CODE_SIZE      11
 
 /* These are legacy.  You probably do not want to call them directly */
 MODULE_API int EGifPutScreenDesc(GifFileType *GifFile,
@@ -165,6 +191,12 @@ MODULE_API int EGifPutImageDesc(GifFileType *GifFile,
 		     const bool GifInterlace,
                      const ColorMapObject *GifColorMap);
 MODULE_API void EGifSetGifVersion(GifFileType *GifFile, const bool gif89);
+MODULE_API int EGifGetClearCount(const GifFileType *GifFile);
+MODULE_API void EGifSetCompressLevel(GifFileType *GifFile, const int Level);
+
+#define GIF_COMPRESS_FAST     0    /* Clear the dictionary whenever full */
+#define GIF_COMPRESS_BALANCED 1    /* Keep it full until the rate degrades */
+#define GIF_COMPRESS_MAX      2    /* Also search where to clear a raster */
 MODULE_API int EGifPutLine(GifFileType *GifFile, GifPixelType *GifLine,
                 int GifLineLen);
 MODULE_API int EGifPutPixel(GifFileType *GifFile, const GifPixelType GifPixel);
@@ -180,6 +212,39 @@ MODULE_API int EGifPutCode(GifFileType *GifFile, int GifCodeSize,
                 const GifByteType *GifCodeBlock);
 MODULE_API int EGifPutCodeNext(GifFileType *GifFile,
                     const GifByteType *GifCodeBlock);
+MODULE_API int EGifPutCompressedImage(GifFileType *GifFile,
+                    const GifCompressedImage *GifImage);
+MODULE_API int EGifPutSavedImage(GifFileType *GifFile,
+                    const SavedImage *Image,
+                    const GifCompressedImage *Compressed);
+MODULE_API bool EGifChangedRect(int Width, int Height, int PlaneCount,
+                    const GifByteType *const *Previous,
+                    const GifByteType *const *Current,
+                    GifImageDesc *Rect);
+MODULE_API int EGifCountChanges(int PixelCount, int PlaneCount,
+                    const GifByteType *const *Previous,
+                    const GifByteType *const *Current,
+                    int Tolerance, int Limit);
+
+/* Compression of images apart from the file, one encoder per thread */
+MODULE_API GifRasterEncoder *EGifNewRasterEncoder(void);
+MODULE_API void EGifFreeRasterEncoder(GifRasterEncoder *Encoder);
+MODULE_API void EGifSetEncoderCompressLevel(GifRasterEncoder *Encoder,
+                    const int Level);
+MODULE_API void EGifSetEncoderLossy(GifRasterEncoder *Encoder,
+                    const int MaxError, const ColorMapObject *ColorMap,
+                    const int TransparentColor);
+MODULE_API int EGifCompressRaster(GifRasterEncoder *Encoder,
+                    GifPixelType *Raster, const int PixelCount,
+                    const int BitsPerPixel, GifCompressedImage *Image);
+MODULE_API void EGifFreeCompressedImage(GifCompressedImage *Image);
+MODULE_API int EGifCompressStrip(GifRasterEncoder *Encoder,
+                    GifPixelType *Raster, const int PixelCount,
+                    const int BitsPerPixel, GifCodeStrip *Strip);
+MODULE_API int EGifJoinStrips(GifRasterEncoder *Encoder,
+                    const GifCodeStrip *Strips, const int StripCount,
+                    GifCompressedImage *Image);
+MODULE_API void EGifFreeCodeStrip(GifCodeStrip *Strip);
 
 /******************************************************************************
  GIF decoding routines
@@ -226,11 +291,96 @@ MODULE_API int DGifGetLZCodes(GifFileType *GifFile, int *GifCode);
 /******************************************************************************
  Color table quantization (deprecated)
 ******************************************************************************/
+
+typedef struct GifQuantizeScratch GifQuantizeScratch;
+
+typedef struct GifQuantizeOptions {
+    int BitsPerPrimColor;    /* Histogram precision, 4, 5 or 6 bits */
+#define GIF_QUANTIZE_DEFAULT_BITS 5
+    int DitherMode;          /* How pixels are mapped to the color map */
+#define GIF_DITHER_NONE            0    /* Nearest color map box */
+#define GIF_DITHER_ORDERED         1    /* 8x8 Bayer threshold matrix */
+#define GIF_DITHER_FLOYD_STEINBERG 2    /* Serpentine error diffusion */
+    GifQuantizeScratch *Scratch; /* Reused work memory, NULL for per call */
+    unsigned int SampleStride;   /* Histogram 1 pixel in N, 0 or 1 for all */
+    unsigned int SampleSeed;     /* 0 samples a grid, else a seeded random */
+    const GifByteType *TransparentMask; /* Nonzero for transparent pixels */
+} GifQuantizeOptions;
+
+typedef struct GifQuantizePalette GifQuantizePalette;
+#define GIF_PALETTE_AUTO_SAMPLES 16384  /* Per image if SampleStride is 0 */
+
 MODULE_API int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
                    int *ColorMapSize, GifByteType * RedInput,
                    GifByteType * GreenInput, GifByteType * BlueInput,
                    GifByteType * OutputBuffer,
                    GifColorType * OutputColorMap);
+MODULE_API int GifQuantizeBufferEx(unsigned int Width, unsigned int Height,
+                   int *ColorMapSize, GifByteType * RedInput,
+                   GifByteType * GreenInput, GifByteType * BlueInput,
+                   GifByteType * OutputBuffer,
+                   GifColorType * OutputColorMap,
+                   const GifQuantizeOptions * Options);
+MODULE_API GifQuantizeScratch *GifNewQuantizeScratch(unsigned int Width,
+                                                     unsigned int Height);
+MODULE_API void GifFreeQuantizeScratch(GifQuantizeScratch *Scratch);
+MODULE_API GifQuantizePalette *GifNewQuantizePalette(
+                   const GifQuantizeOptions * Options);
+MODULE_API void GifQuantizePaletteReset(GifQuantizePalette *Palette);
+MODULE_API int GifQuantizePaletteAdd(GifQuantizePalette *Palette,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType * RedInput,
+                   const GifByteType * GreenInput,
+                   const GifByteType * BlueInput);
+MODULE_API int GifQuantizePaletteBuild(GifQuantizePalette *Palette,
+                   int *ColorMapSize, GifColorType * OutputColorMap);
+MODULE_API int GifQuantizePaletteMap(GifQuantizePalette *Palette,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType * RedInput,
+                   const GifByteType * GreenInput,
+                   const GifByteType * BlueInput,
+                   GifByteType * OutputBuffer);
+MODULE_API void GifFreeQuantizePalette(GifQuantizePalette *Palette);
+
+MODULE_API int GifPruneColorMap(unsigned long NumPixels,
+                   GifByteType * IndexBuffer,
+                   int *ColorMapSize,
+                   GifColorType * ColorMap);
+
+typedef struct GifQuantizeReport {
+    double PSNR;             /* Peak signal to noise ratio in dB */
+#define GIF_PSNR_IDENTICAL 99.0
+    int MaxError[3];         /* Largest red, green and blue error */
+    double SSIM;             /* Mean structural similarity of the luma */
+} GifQuantizeReport;
+
+MODULE_API int GifQuantizeMetrics(unsigned int Width, unsigned int Height,
+                   const GifByteType * RedInput,
+                   const GifByteType * GreenInput,
+                   const GifByteType * BlueInput,
+                   const GifByteType * IndexBuffer,
+                   const GifColorType * ColorMap,
+                   GifQuantizeReport * Report);
+
+/* Running sums of GifQuantizeMetricsRows over a band of rows */
+typedef struct GifQuantizeSums {
+    unsigned long long SquaredError;
+    unsigned long NumPixels;
+    int MaxError[3];
+    double SSIMSum;
+    unsigned long NumWindows;
+} GifQuantizeSums;
+
+MODULE_API int GifQuantizeMetricsRows(unsigned int Width, unsigned int Height,
+                   unsigned int FirstRow, unsigned int EndRow,
+                   const GifByteType * RedInput,
+                   const GifByteType * GreenInput,
+                   const GifByteType * BlueInput,
+                   const GifByteType * IndexBuffer,
+                   const GifColorType * ColorMap,
+                   GifQuantizeSums * Sums);
+MODULE_API int GifQuantizeMetricsReport(const GifQuantizeSums * Sums,
+                   int SumCount, GifQuantizeReport * Report);
 
 /******************************************************************************
  Error handling and reporting.
@@ -270,6 +420,8 @@ extern MODULE_API void GifFreeExtensions(int *ExtensionBlock_Count,
 			      ExtensionBlock **ExtensionBlocks);
 extern MODULE_API SavedImage *GifMakeSavedImage(GifFileType *GifFile,
                                   const SavedImage *CopyFrom);
+extern MODULE_API int GifReserveSavedImages(GifFileType *GifFile,
+                                  int ImageCapacity);
 extern MODULE_API void GifFreeSavedImages(GifFileType *GifFile);
 
 /******************************************************************************
@@ -21,6 +21,8 @@ gif_lib_private.h - internal giflib routines and structures
 #define FIRST_CODE          4097    /* Impossible code, to signal first. */
 #define NO_SUCH_CODE        4098    /* Impossible code, to signal empty. */
 
+#define LOSSY_NEAR_COLORS   8       /* Colors tried for a lossy match. */
+
 #define FILE_STATE_WRITE    0x01
 #define FILE_STATE_SCREEN   0x02
 #define FILE_STATE_IMAGE    0x04
@@ -51,9 +53,45 @@ typedef struct GifFilePrivateType {
     GifByteType Suffix[LZ_MAX_CODE + 1];    /* So we can trace the codes. */
     GifPrefixType Prefix[LZ_MAX_CODE + 1];
     GifHashTableType *HashTable;
+    int ClearCount;	/* Dictionary resets in the image being written */
+    uint64_t CodeAcc;	/* Codes not yet stored in CodeBuf, low bits first */
+    int CodeAccBits;	/* Number of bits in CodeAcc. */
+    GifByteType *CodeBuf;	/* Packed codes of the image being written */
+    size_t CodeBufLen, CodeBufSize;
+    int CompressLevel;	/* GIF_COMPRESS_FAST, _BALANCED or _MAX */
+    int WindowLeft;	/* Pixels until the output rate is checked again */
+    size_t WindowStartBits, BestWindowBits;	/* Bits at window start, fewest per window */
+    int LossyError;	/* Farthest color a lossy match may take, 0 for none */
+    const ColorMapObject *LossyColorMap;	/* Colors of the images compressed next */
+    int LossyTransparent;	/* Their transparent color, never matched */
+    GifByteType LossyNearCount[256];	/* Colors close enough to every pixel, */
+    GifPixelType LossyNear[256][LOSSY_NEAR_COLORS];	/* nearest first */
+    unsigned long LossyPixels;	/* Pixels written as a near color */
     bool gif89;
 } GifFilePrivateType;
 
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Make room for one more image in SavedImages, doubling it when full */
+extern int GifGrowSavedImages(GifFileType *GifFile);
+/* GifAddExtensionBlock on an array whose capacity the library keeps, doubling it when full */
+extern int GifAddGrowingExtensionBlock(int *ExtensionBlockCount,
+                                       int *ExtensionBlockCapacity,
+                                       ExtensionBlock **ExtensionBlocks,
+                                       int Function, unsigned int Len,
+                                       unsigned char ExtData[]);
+/* LZ compress LineLen more pixels of the image, in egif_lzw.cpp */
+extern int EGifCompressLine(GifFilePrivateType *Private, GifPixelType *Line,
+                            int LineLen);
+/* Make room in the code buffer for Bytes more bytes */
+extern int EGifReserveCodes(GifFilePrivateType *Private, size_t Bytes);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* _GIF_LIB_PRIVATE_H */
 
 /* end */